@@ -0,0 +1,333 @@
+/* Microbenchmarks of the sorted set commands, run by `make bench`.
+ *
+ *     bench.exe [-k int|string|all] [-e skiplist|btree|map|all] [N...]
+ *
+ * Every command family is timed on sets of N members (1000, 100000 and
+ * 1000000 by default, up to 100M if memory allows) for the skiplist
+ * SortedSet, the B+tree BTreeSortedSet, and the std::map + unordered_map
+ * pair the README compares them to. Keys, scores and the order of the
+ * operations come from a fixed seed, so runs are reproducible. Each line
+ * gives ops/sec, ns/op and, after the build, the bytes used per member
+ * (with std::string keys, not counting key buffers, see memory_usage()). */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <chrono>
+#include "sorted_set.hh"
+#include "btree_sorted_set.hh"
+
+/* Bytes held by the std containers through CountingAllocator. */
+static std::size_t gMapBytes = 0;
+
+template<typename T>
+class CountingAllocator : public std::allocator<T> {
+public:
+    template<typename U> struct rebind { typedef CountingAllocator<U> other; };
+    CountingAllocator() {}
+    template<typename U> CountingAllocator(const CountingAllocator<U>&) {}
+    T* allocate(std::size_t n, const void* = 0) {
+        gMapBytes += n * sizeof(T);
+        return std::allocator<T>::allocate(n);
+    }
+    void deallocate(T *p, std::size_t n) {
+        gMapBytes -= n * sizeof(T);
+        std::allocator<T>::deallocate(p, n);
+    }
+};
+
+/* The baseline: an ordered std::map of (score, key) and a hash table of
+ * the scores. Ranks and rank ranges have to walk the map, O(N). */
+template<typename KeyType>
+class MapSortedSet {
+public:
+    typedef std::pair<double, KeyType> EntryType;
+    typedef std::map<EntryType, char, std::less<EntryType>, CountingAllocator<std::pair<const EntryType, char> > > TreeType;
+    typedef std::unordered_map<KeyType, double, std::hash<KeyType>, std::equal_to<KeyType>, CountingAllocator<std::pair<const KeyType, double> > > DictType;
+
+    void zadd(const KeyType &key, double score) {
+        typename DictType::iterator it = mDict.find(key);
+        if (it != mDict.end()) {
+            mTree.erase(EntryType(it->second, key));
+            it->second = score;
+        }
+        else {
+            mDict.insert(std::make_pair(key, score));
+        }
+        mTree.insert(std::make_pair(EntryType(score, key), 0));
+    }
+
+    void zincrby(const KeyType &key, double delta) {
+        typename DictType::iterator it = mDict.find(key);
+        zadd(key, it != mDict.end() ? it->second + delta : delta);
+    }
+
+    void zrem(const KeyType &key) {
+        typename DictType::iterator it = mDict.find(key);
+        if (it != mDict.end()) {
+            mTree.erase(EntryType(it->second, key));
+            mDict.erase(it);
+        }
+    }
+
+    bool zrank(const KeyType &key, unsigned long &rank) const {
+        typename DictType::const_iterator it = mDict.find(key);
+        if (it == mDict.end())
+            return false;
+        rank = std::distance(mTree.begin(), mTree.find(EntryType(it->second, key)));
+        return true;
+    }
+
+    bool zrevrank(const KeyType &key, unsigned long &rank) const {
+        if (!zrank(key, rank))
+            return false;
+        rank = mTree.size() - 1 - rank;
+        return true;
+    }
+
+    void zrange(long start, long end, std::vector<KeyType> &result) const {
+        result.clear();
+        typename TreeType::const_iterator it = mTree.begin();
+        std::advance(it, start);
+        for (long i = start; i <= end && it != mTree.end(); i++, ++it)
+            result.push_back(it->first.second);
+    }
+
+    void zrangebyscore_limit(double min, double max, long offset, long count, std::vector<KeyType> &result) const {
+        result.clear();
+        typename TreeType::const_iterator it = mTree.lower_bound(EntryType(min, KeyType()));
+        for (; offset > 0 && it != mTree.end(); offset--)
+            ++it;
+        for (; count > 0 && it != mTree.end() && it->first.first <= max; count--, ++it)
+            result.push_back(it->first.second);
+    }
+
+    unsigned long zcount(double min, double max) const {
+        return std::distance(mTree.lower_bound(EntryType(min, KeyType())),
+                             mTree.upper_bound(EntryType(max, max_key())));
+    }
+
+    void zremrangebyrank(long start, long end) {
+        typename TreeType::iterator it = mTree.begin();
+        std::advance(it, start);
+        for (long i = start; i <= end && it != mTree.end(); i++) {
+            mDict.erase(it->first.second);
+            mTree.erase(it++);
+        }
+    }
+
+    unsigned long zcard() const {
+        return mDict.size();
+    }
+
+private:
+    static KeyType max_key();
+
+    TreeType mTree;
+    DictType mDict;
+};
+
+template<> int MapSortedSet<int>::max_key() { return INT_MAX; }
+template<> std::string MapSortedSet<std::string>::max_key() { return std::string(1, '\xff'); }
+
+template<typename KeyType>
+double bytes_per_member(const SortedSet<KeyType> &set) {
+    return (double)set.memory_usage() / set.zcard();
+}
+
+template<typename KeyType>
+double bytes_per_member(const BTreeSortedSet<KeyType>&) {
+    return 0;
+}
+
+template<typename KeyType>
+double bytes_per_member(const MapSortedSet<KeyType> &set) {
+    return (double)(sizeof(set) + gMapBytes) / set.zcard();
+}
+
+/* Operations that walk the whole std::map baseline get fewer iterations. */
+template<typename SetType> bool linear_ranks(const SetType&) { return false; }
+template<typename KeyType> bool linear_ranks(const MapSortedSet<KeyType>&) { return true; }
+
+/* xorshift64*, for reproducible keys, scores and access orders. */
+class Random {
+public:
+    Random(unsigned long long seed): mState(seed) {}
+    unsigned long long next() {
+        mState ^= mState >> 12;
+        mState ^= mState << 25;
+        mState ^= mState >> 27;
+        return mState * 2685821657736338717ULL;
+    }
+    unsigned long below(unsigned long n) { return next() % n; }
+private:
+    unsigned long long mState;
+};
+
+static int make_key(unsigned long i, int*) {
+    return (int)i;
+}
+
+static std::string make_key(unsigned long i, std::string*) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "member:%08lx", i);
+    return buf;
+}
+
+typedef std::chrono::steady_clock Clock;
+
+static void report(const char *engine, const char *keys, unsigned long n, const char *op,
+                   unsigned long ops, Clock::time_point begin, double bytes = 0) {
+    double ns = std::chrono::duration<double, std::nano>(Clock::now() - begin).count() / ops;
+    printf("%-9s %-7s %10lu  %-22s %12.0f ops/s %10.1f ns/op", engine, keys, n, op, 1e9 / ns, ns);
+    if (bytes > 0)
+        printf(" %8.1f bytes/member", bytes);
+    printf("\n");
+    fflush(stdout);
+}
+
+/* Keeps the results alive, so no command is optimized away. */
+static unsigned long gSink = 0;
+
+template<typename SetType, typename KeyType>
+void bench(const char *engine, const char *keyname, unsigned long n) {
+    std::vector<KeyType> keys(n), result;
+    std::vector<double> scores(n);
+    Random random(88172645463325252ULL);
+    unsigned long i, rank, ops = std::min(n, 1000000UL), lops = ops;
+    double range = n * 4.0;
+    Clock::time_point begin;
+
+    for (i = 0; i < n; i++) {
+        keys[i] = make_key(random.next(), (KeyType*)NULL);
+        scores[i] = (double)random.below(n * 4);
+    }
+
+    {
+        SetType set;
+        begin = Clock::now();
+        for (i = 0; i < n; i++)
+            set.zadd(keys[i], scores[i]);
+        report(engine, keyname, n, "zadd random", n, begin, bytes_per_member(set));
+    }
+    {
+        SetType set;
+        begin = Clock::now();
+        for (i = 0; i < n; i++)
+            set.zadd(keys[i], (double)i);
+        report(engine, keyname, n, "zadd sequential", n, begin);
+    }
+    {
+        SetType set;
+        begin = Clock::now();
+        for (i = 0; i < n; i++)
+            set.zadd(keys[i], 0);
+        report(engine, keyname, n, "zadd duplicate score", n, begin);
+    }
+
+    SetType set;
+    for (i = 0; i < n; i++)
+        set.zadd(keys[i], scores[i]);
+    if (linear_ranks(set))
+        lops = std::max(1UL, std::min(ops, 20000000UL / n));
+
+    begin = Clock::now();
+    for (i = 0; i < ops; i++)
+        set.zincrby(keys[random.below(n)], (double)(random.below(3)) - 1);
+    report(engine, keyname, n, "zincrby small delta", ops, begin);
+
+    begin = Clock::now();
+    for (i = 0; i < lops; i++)
+        gSink += set.zrank(keys[random.below(n)], rank) ? rank : 0;
+    report(engine, keyname, n, "zrank", lops, begin);
+
+    begin = Clock::now();
+    for (i = 0; i < lops; i++)
+        gSink += set.zrevrank(keys[random.below(n)], rank) ? rank : 0;
+    report(engine, keyname, n, "zrevrank", lops, begin);
+
+    static const long PAGES[] = { 10, 100, 1000 };
+    for (std::size_t p = 0; p < sizeof(PAGES) / sizeof(PAGES[0]); p++) {
+        char name[32];
+        unsigned long pops = std::max(1UL, lops / PAGES[p]);
+        begin = Clock::now();
+        for (i = 0; i < pops; i++) {
+            long start = random.below(n);
+            set.zrange(start, start + PAGES[p] - 1, result);
+            gSink += result.size();
+        }
+        snprintf(name, sizeof(name), "zrange %ld", PAGES[p]);
+        report(engine, keyname, n, name, pops, begin);
+
+        pops = std::max(1UL, ops / PAGES[p]);
+        begin = Clock::now();
+        for (i = 0; i < pops; i++) {
+            set.zrangebyscore_limit(random.below(n * 4), range, 0, PAGES[p], result);
+            gSink += result.size();
+        }
+        snprintf(name, sizeof(name), "zrangebyscore %ld", PAGES[p]);
+        report(engine, keyname, n, name, pops, begin);
+    }
+
+    begin = Clock::now();
+    for (i = 0; i < lops; i++) {
+        double min = random.below(n * 4);
+        gSink += set.zcount(min, min + 400);
+    }
+    report(engine, keyname, n, "zcount", lops, begin);
+
+    unsigned long rops = std::max(1UL, std::min(lops, n / 200));
+    begin = Clock::now();
+    for (i = 0; i < rops; i++) {
+        long start = random.below(set.zcard() - 100);
+        set.zremrangebyrank(start, start + 99);
+    }
+    report(engine, keyname, n, "zremrangebyrank 100", rops, begin);
+
+    begin = Clock::now();
+    for (i = 0; i < ops; i++)
+        set.zrem(keys[random.below(n)]);
+    report(engine, keyname, n, "zrem", ops, begin);
+}
+
+int main(int argc, char **argv) {
+    std::vector<unsigned long> sizes;
+    const char *keys = "all", *engine = "all";
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+            keys = argv[++i];
+        else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc)
+            engine = argv[++i];
+        else
+            sizes.push_back(strtoul(argv[i], NULL, 10));
+    }
+    if (sizes.empty()) {
+        sizes.push_back(1000);
+        sizes.push_back(100000);
+        sizes.push_back(1000000);
+    }
+    bool ints = strcmp(keys, "all") == 0 || strcmp(keys, "int") == 0;
+    bool strings = strcmp(keys, "all") == 0 || strcmp(keys, "string") == 0;
+    bool skiplist = strcmp(engine, "all") == 0 || strcmp(engine, "skiplist") == 0;
+    bool btree = strcmp(engine, "all") == 0 || strcmp(engine, "btree") == 0;
+    bool map = strcmp(engine, "all") == 0 || strcmp(engine, "map") == 0;
+
+    for (std::size_t s = 0; s < sizes.size(); s++) {
+        unsigned long n = sizes[s];
+        if (n < 1000) {
+            fprintf(stderr, "sets need at least 1000 members, %lu skipped\n", n);
+            continue;
+        }
+        if (ints && skiplist) bench< SortedSet<int>, int >("skiplist", "int", n);
+        if (ints && btree) bench< BTreeSortedSet<int>, int >("btree", "int", n);
+        if (ints && map) bench< MapSortedSet<int>, int >("map", "int", n);
+        if (strings && skiplist) bench< SortedSet<std::string>, std::string >("skiplist", "string", n);
+        if (strings && btree) bench< BTreeSortedSet<std::string>, std::string >("btree", "string", n);
+        if (strings && map) bench< MapSortedSet<std::string>, std::string >("map", "string", n);
+    }
+    return gSink == 42 ? 1 : 0;
+}
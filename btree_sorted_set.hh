@@ -0,0 +1,1063 @@
+/*******************************************************************************
+ *
+ *      @file: btree_sorted_set.hh
+ *
+ *      @brief: The Sorted Set again, on an order statistic B+tree instead of
+ *              a skiplist: the elements are kept in wide nodes (Fanout of
+ *              them per node, 32 by default), sorted by score then key, and
+ *              inner nodes count the elements below each child, so ranks
+ *              are found with a handful of cache misses per lookup instead
+ *              of one per skiplist hop. Same commands as SortedSet, so one
+ *              may replace the other (and be benchmarked against it) as the
+ *              SetType of ConcurrentSortedSet or ShardedSortedSet.
+ *
+ *      COPYRIGHT (C) 2013.
+ *
+ ******************************************************************************/
+#ifndef BTREE_SORTEDSET_hh_INCLUDED
+#define BTREE_SORTEDSET_hh_INCLUDED
+
+#include "sorted_set.hh"
+
+/* Members are looked up by key in an unordered_map holding their score,
+ * then found in the tree by (score, key). Leaves and inner nodes keep their
+ * scores in a plain array, searched with one compare per entry in a loop
+ * the compiler vectorizes, keys are only compared on score ties. Nodes are
+ * at least half full, except the root. The compact encoding, frozen views,
+ * snapshots and zunionstore/zinterstore are SortedSet only. */
+template< typename KeyType,
+          typename HashFn = HASHSCOPE::hash<KeyType>,
+          typename EqualKey = std::equal_to<KeyType>,
+          typename KeyCompare = std::less<KeyType>,
+          typename ScoreType = double,
+          unsigned int Fanout = 32 >
+class BTreeSortedSet {
+public:
+    typedef KeyType key_type;
+    typedef ScoreType score_type;
+    typedef SortedSetScoreTraits<ScoreType> score_traits;
+    typedef HashFn hasher;
+    typedef KeyCompare key_compare;
+    typedef typename std::vector<KeyType> KeyVecType;
+    typedef typename std::pair<KeyType, ScoreType> KeyScorePairType;
+    typedef typename std::vector<KeyScorePairType> KeyScoreVecType;
+
+    /* Same as SortedSet::LexBound. */
+    class LexBound {
+    public:
+        static LexBound inclusive(const KeyType &key) { return LexBound(key, false, false); }
+        static LexBound exclusive(const KeyType &key) { return LexBound(key, true, false); }
+        static LexBound unbounded() { return LexBound(KeyType(), false, true); }
+    private:
+        friend class BTreeSortedSet;
+        LexBound(const KeyType &key, bool exclusive, bool unbounded)
+            : mKey(key), mExclusive(exclusive), mUnbounded(unbounded) {}
+        KeyType mKey;
+        bool mExclusive, mUnbounded;
+    };
+
+private:
+    static_assert(Fanout >= 4, "B+tree nodes need room for two halves of at least two entries");
+    static const unsigned int MIN_FILL = Fanout / 2;
+    /* Nodes are at least half full, so this is plenty for any 64 bits count. */
+    static const int MAX_HEIGHT = 64;
+
+    class Node {
+    public:
+        Node(bool leaf): mLeaf(leaf), mSize(0) {}
+        bool mLeaf;
+        unsigned int mSize;
+        /* Sorted by score then key: the elements of a leaf, or in an inner
+         * node a lower bound of the elements below each child (the one of
+         * child 0 is not used). */
+        ScoreType mScores[Fanout];
+        KeyType mKeys[Fanout];
+    };
+
+    class Leaf : public Node {
+    public:
+        Leaf(): Node(true), mPrev(NULL), mNext(NULL) {}
+        Leaf *mPrev, *mNext;
+    };
+
+    class Inner : public Node {
+    public:
+        Inner(): Node(false) {}
+        /* How many elements there are below each child. */
+        unsigned long mCounts[Fanout];
+        Node *mChildren[Fanout];
+    };
+
+    /* The way down to one position of a leaf: the inner node of every depth
+     * (the root first) and which of its children was taken. */
+    class Path {
+    public:
+        Inner *mInner[MAX_HEIGHT];
+        unsigned int mChild[MAX_HEIGHT];
+        int mDepth;
+        Leaf *mLeaf;
+        unsigned int mPos;
+    };
+
+    /* Predicates true for a prefix of the elements, see descend(). */
+    class Before {
+    public:
+        Before(ScoreType score, const KeyType &key, const KeyCompare &cmp): mScore(score), mKey(key), mCmp(cmp) {}
+        bool operator()(ScoreType score, const KeyType &key) const {
+            return score < mScore || (score == mScore && mCmp(key, mKey));
+        }
+    private:
+        ScoreType mScore;
+        const KeyType &mKey;
+        const KeyCompare &mCmp;
+    };
+
+    /* Lookups and inserts go down with this one: it leads to the child
+     * holding (score, key), also when that is the first element of it, and
+     * puts new elements at the start of the child whose separator they equal
+     * (separators are not updated when elements are removed). */
+    class NotAfter {
+    public:
+        NotAfter(ScoreType score, const KeyType &key, const KeyCompare &cmp): mScore(score), mKey(key), mCmp(cmp) {}
+        bool operator()(ScoreType score, const KeyType &key) const {
+            return score < mScore || (score == mScore && !mCmp(mKey, key));
+        }
+    private:
+        ScoreType mScore;
+        const KeyType &mKey;
+        const KeyCompare &mCmp;
+    };
+
+    /* The elements before a score range starting at 'min'. */
+    class ScoreBelow {
+    public:
+        ScoreBelow(ScoreType min, bool minex): mMin(min), mMinex(minex) {}
+        bool operator()(ScoreType score, const KeyType &) const {
+            return mMinex ? !(score > mMin) : score < mMin;
+        }
+    private:
+        ScoreType mMin;
+        bool mMinex;
+    };
+
+    /* The elements up to the end of a score range ending at 'max'. */
+    class ScoreUpTo {
+    public:
+        ScoreUpTo(ScoreType max, bool maxex): mMax(max), mMaxex(maxex) {}
+        bool operator()(ScoreType score, const KeyType &) const {
+            return mMaxex ? score < mMax : !(score > mMax);
+        }
+    private:
+        ScoreType mMax;
+        bool mMaxex;
+    };
+
+    class LexBelow {
+    public:
+        LexBelow(const LexBound &min, const KeyCompare &cmp): mMin(min), mCmp(cmp) {}
+        bool operator()(ScoreType, const KeyType &key) const {
+            if (mMin.mUnbounded) return false;
+            return mMin.mExclusive ? !mCmp(mMin.mKey, key) : mCmp(key, mMin.mKey);
+        }
+    private:
+        const LexBound &mMin;
+        const KeyCompare &mCmp;
+    };
+
+    class LexUpTo {
+    public:
+        LexUpTo(const LexBound &max, const KeyCompare &cmp): mMax(max), mCmp(cmp) {}
+        bool operator()(ScoreType, const KeyType &key) const {
+            if (mMax.mUnbounded) return true;
+            return mMax.mExclusive ? mCmp(key, mMax.mKey) : !mCmp(mMax.mKey, key);
+        }
+    private:
+        const LexBound &mMax;
+        const KeyCompare &mCmp;
+    };
+
+    typedef HASHSCOPE::unordered_map<KeyType, ScoreType, HashFn, EqualKey> DictType;
+
+public:
+    /* Same as SortedSet::Iterator, on (leaf, position) pairs. */
+    template<bool Reverse>
+    class Iterator {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef KeyType value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const KeyType *pointer;
+        typedef const KeyType &reference;
+
+        Iterator(): mLeaf(NULL), mPos(0), mSet(NULL) {}
+
+        reference operator*() const { return key(); }
+        pointer operator->() const { return &key(); }
+        const KeyType& key() const { return mLeaf->mKeys[mPos]; }
+        ScoreType score() const { return mLeaf->mScores[mPos]; }
+
+        Iterator& operator++() {
+            if (Reverse) back(); else forth();
+            return *this;
+        }
+
+        Iterator& operator--() {
+            /* Stepping back from the end lands on the last element. */
+            if (mLeaf == NULL) {
+                mLeaf = Reverse ? mSet->mFirst : mSet->mLast;
+                mPos = Reverse ? 0 : mLeaf->mSize - 1;
+            }
+            else if (Reverse) {
+                forth();
+            }
+            else {
+                back();
+            }
+            return *this;
+        }
+
+        Iterator operator++(int) { Iterator tmp(*this); ++*this; return tmp; }
+        Iterator operator--(int) { Iterator tmp(*this); --*this; return tmp; }
+        bool operator==(const Iterator &other) const { return mLeaf == other.mLeaf && mPos == other.mPos; }
+        bool operator!=(const Iterator &other) const { return !(*this == other); }
+
+    private:
+        friend class BTreeSortedSet;
+        Iterator(const Leaf *leaf, unsigned int pos, const BTreeSortedSet *set): mLeaf(leaf), mPos(pos), mSet(set) {}
+
+        void forth() {
+            if (++mPos == mLeaf->mSize) {
+                mLeaf = mLeaf->mNext;
+                mPos = 0;
+            }
+        }
+
+        void back() {
+            if (mPos > 0) {
+                mPos--;
+            }
+            else {
+                mLeaf = mLeaf->mPrev;
+                mPos = mLeaf ? mLeaf->mSize - 1 : 0;
+            }
+        }
+
+        const Leaf *mLeaf;
+        unsigned int mPos;
+        const BTreeSortedSet *mSet;
+    };
+
+    template<typename IteratorType>
+    class View {
+    public:
+        View(IteratorType first, IteratorType last): mBegin(first), mEnd(last) {}
+        IteratorType begin() const { return mBegin; }
+        IteratorType end() const { return mEnd; }
+        bool empty() const { return mBegin == mEnd; }
+    private:
+        IteratorType mBegin, mEnd;
+    };
+
+    typedef Iterator<false> const_iterator;
+    typedef Iterator<true> const_reverse_iterator;
+    typedef View<const_iterator> RangeViewType;
+    typedef View<const_reverse_iterator> ReverseRangeViewType;
+
+private:
+    static unsigned long node_count(const Node *n) {
+        if (n->mLeaf)
+            return n->mSize;
+        const Inner *in = static_cast<const Inner*>(n);
+        unsigned long count = 0;
+        for (unsigned int i = 0; i < in->mSize; i++)
+            count += in->mCounts[i];
+        return count;
+    }
+
+    /* Number of entries of a node, from 'from' on, for which pred holds: they
+     * come first, so this is where the others start. The loop has no early
+     * exit, so it is vectorized for predicates on scores only. */
+    template<typename Pred>
+    static unsigned int node_prefix(const Node *n, unsigned int from, const Pred &pred) {
+        unsigned int count = from;
+        for (unsigned int i = from; i < n->mSize; i++)
+            count += pred(n->mScores[i], n->mKeys[i]);
+        return count;
+    }
+
+    /* Count the elements for which pred holds, those of a prefix of the set,
+     * and fill 'path' (when not NULL) with the way to the first one for which
+     * it does not. Children before the last separator for which pred holds
+     * only have such elements, the children after it none. */
+    template<typename Pred>
+    unsigned long descend(const Pred &pred, Path *path) const {
+        const Node *n = mRoot;
+        unsigned long rank = 0;
+        int depth = 0;
+        while (!n->mLeaf) {
+            const Inner *in = static_cast<const Inner*>(n);
+            unsigned int c = node_prefix(in, 1, pred) - 1;
+            for (unsigned int i = 0; i < c; i++)
+                rank += in->mCounts[i];
+            if (path != NULL) {
+                path->mInner[depth] = const_cast<Inner*>(in);
+                path->mChild[depth] = c;
+            }
+            depth++;
+            n = in->mChildren[c];
+        }
+        unsigned int pos = node_prefix(n, 0, pred);
+        if (path != NULL) {
+            path->mDepth = depth;
+            path->mLeaf = const_cast<Leaf*>(static_cast<const Leaf*>(n));
+            path->mPos = pos;
+        }
+        return rank + pos;
+    }
+
+    /* The way to the element of 0-based rank 'rank', which must be there. */
+    void locate(unsigned long rank, Path &path) const {
+        const Node *n = mRoot;
+        int depth = 0;
+        while (!n->mLeaf) {
+            const Inner *in = static_cast<const Inner*>(n);
+            unsigned int c = 0;
+            while (rank >= in->mCounts[c])
+                rank -= in->mCounts[c++];
+            path.mInner[depth] = const_cast<Inner*>(in);
+            path.mChild[depth] = c;
+            depth++;
+            n = in->mChildren[c];
+        }
+        path.mDepth = depth;
+        path.mLeaf = const_cast<Leaf*>(static_cast<const Leaf*>(n));
+        path.mPos = rank;
+    }
+
+    /* The way to the element (score, key), which must be there. */
+    void find(ScoreType score, const KeyType &key, Path &path) const {
+        descend(NotAfter(score, key, mKeyCompare), &path);
+        path.mPos--;
+    }
+
+    /* Shift the entries from 'pos' on by one, to make room at 'pos' or to
+     * overwrite it. Inner nodes shift their counts and children along. */
+    static void open_entry(Node *n, unsigned int pos) {
+        for (unsigned int i = n->mSize; i > pos; i--)
+            move_entry(n, i, n, i-1);
+        n->mSize++;
+    }
+
+    static void close_entry(Node *n, unsigned int pos) {
+        for (unsigned int i = pos; i + 1 < n->mSize; i++)
+            move_entry(n, i, n, i+1);
+        n->mSize--;
+    }
+
+    static void move_entry(Node *dst, unsigned int i, Node *src, unsigned int j) {
+        dst->mScores[i] = src->mScores[j];
+        dst->mKeys[i] = std::move(src->mKeys[j]);
+        if (!dst->mLeaf) {
+            static_cast<Inner*>(dst)->mCounts[i] = static_cast<Inner*>(src)->mCounts[j];
+            static_cast<Inner*>(dst)->mChildren[i] = static_cast<Inner*>(src)->mChildren[j];
+        }
+    }
+
+    /* Move the upper half of a full node into a new one, its right sibling. */
+    Node* split_node(Node *n) {
+        Node *right;
+        if (n->mLeaf) {
+            Leaf *l = static_cast<Leaf*>(n), *r = new Leaf;
+            r->mPrev = l;
+            r->mNext = l->mNext;
+            if (l->mNext != NULL)
+                l->mNext->mPrev = r;
+            else
+                mLast = r;
+            l->mNext = r;
+            right = r;
+        }
+        else {
+            right = new Inner;
+        }
+        unsigned int half = n->mSize / 2;
+        for (unsigned int i = half; i < n->mSize; i++)
+            move_entry(right, i - half, n, i);
+        right->mSize = n->mSize - half;
+        n->mSize = half;
+        return right;
+    }
+
+    /* Link 'child', the new right sibling of the child taken at depth d of the
+     * path, into its parent, splitting the parents as needed. */
+    void add_child(Path &path, int d, Node *child) {
+        if (d < 0) {
+            Inner *root = new Inner;
+            root->mSize = 2;
+            root->mChildren[0] = mRoot;
+            root->mCounts[0] = node_count(mRoot);
+            root->mChildren[1] = child;
+            root->mCounts[1] = node_count(child);
+            root->mScores[1] = child->mScores[0];
+            root->mKeys[1] = child->mKeys[0];
+            mRoot = root;
+            return;
+        }
+        Inner *p = path.mInner[d];
+        unsigned int c = path.mChild[d];
+        Node *left = p->mChildren[c];
+        Inner *right = NULL;
+        if (p->mSize == Fanout) {
+            right = static_cast<Inner*>(split_node(p));
+            if (c >= p->mSize) {
+                c -= p->mSize;
+                p = right;
+            }
+        }
+        open_entry(p, c + 1);
+        p->mChildren[c+1] = child;
+        p->mScores[c+1] = child->mScores[0];
+        p->mKeys[c+1] = child->mKeys[0];
+        p->mCounts[c] = node_count(left);
+        p->mCounts[c+1] = node_count(child);
+        if (right != NULL)
+            add_child(path, d - 1, right);
+    }
+
+    /* Insert (score, key) where the path leads. */
+    void insert_at(Path &path, ScoreType score, const KeyType &key) {
+        for (int d = 0; d < path.mDepth; d++)
+            path.mInner[d]->mCounts[path.mChild[d]]++;
+        Leaf *l = path.mLeaf;
+        unsigned int pos = path.mPos;
+        Node *right = NULL;
+        if (l->mSize == Fanout) {
+            right = split_node(l);
+            if (pos > l->mSize) {
+                pos -= l->mSize;
+                l = static_cast<Leaf*>(right);
+            }
+        }
+        open_entry(l, pos);
+        l->mScores[pos] = score;
+        l->mKeys[pos] = key;
+        if (right != NULL)
+            add_child(path, path.mDepth - 1, right);
+    }
+
+    /* Child c of p takes the last entry of its left sibling. */
+    static void borrow_left(Inner *p, unsigned int c) {
+        Node *l = p->mChildren[c-1], *n = p->mChildren[c];
+        open_entry(n, 0);
+        move_entry(n, 0, l, l->mSize - 1);
+        l->mSize--;
+        unsigned long moved = 1;
+        if (!n->mLeaf) {
+            /* The old first child of n gets the lower bound n had. */
+            n->mScores[1] = p->mScores[c];
+            n->mKeys[1] = p->mKeys[c];
+            moved = static_cast<Inner*>(n)->mCounts[0];
+        }
+        p->mScores[c] = n->mScores[0];
+        p->mKeys[c] = n->mKeys[0];
+        p->mCounts[c-1] -= moved;
+        p->mCounts[c] += moved;
+    }
+
+    /* Child c of p takes the first entry of its right sibling. */
+    static void borrow_right(Inner *p, unsigned int c) {
+        Node *n = p->mChildren[c], *r = p->mChildren[c+1];
+        move_entry(n, n->mSize, r, 0);
+        unsigned long moved = 1;
+        if (!n->mLeaf) {
+            n->mScores[n->mSize] = p->mScores[c+1];
+            n->mKeys[n->mSize] = p->mKeys[c+1];
+            moved = static_cast<Inner*>(n)->mCounts[n->mSize];
+        }
+        n->mSize++;
+        close_entry(r, 0);
+        p->mScores[c+1] = r->mScores[0];
+        p->mKeys[c+1] = r->mKeys[0];
+        p->mCounts[c] += moved;
+        p->mCounts[c+1] -= moved;
+    }
+
+    /* Append child c+1 of p to child c, and drop it. */
+    void merge_children(Inner *p, unsigned int c) {
+        Node *l = p->mChildren[c], *r = p->mChildren[c+1];
+        unsigned int base = l->mSize;
+        for (unsigned int i = 0; i < r->mSize; i++)
+            move_entry(l, base + i, r, i);
+        l->mSize += r->mSize;
+        if (l->mLeaf) {
+            Leaf *ll = static_cast<Leaf*>(l), *rl = static_cast<Leaf*>(r);
+            ll->mNext = rl->mNext;
+            if (rl->mNext != NULL)
+                rl->mNext->mPrev = ll;
+            else
+                mLast = ll;
+            delete rl;
+        }
+        else {
+            l->mScores[base] = p->mScores[c+1];
+            l->mKeys[base] = p->mKeys[c+1];
+            delete static_cast<Inner*>(r);
+        }
+        p->mCounts[c] += p->mCounts[c+1];
+        close_entry(p, c + 1);
+    }
+
+    /* Remove the element the path leads to, then refill the nodes left less
+     * than half full from their siblings, or merge them with one. */
+    void erase_at(Path &path) {
+        for (int d = 0; d < path.mDepth; d++)
+            path.mInner[d]->mCounts[path.mChild[d]]--;
+        Node *n = path.mLeaf;
+        close_entry(n, path.mPos);
+        for (int d = path.mDepth - 1; d >= 0 && n->mSize < MIN_FILL; d--) {
+            Inner *p = path.mInner[d];
+            unsigned int c = path.mChild[d];
+            if (c > 0 && p->mChildren[c-1]->mSize > MIN_FILL)
+                borrow_left(p, c);
+            else if (c + 1 < p->mSize && p->mChildren[c+1]->mSize > MIN_FILL)
+                borrow_right(p, c);
+            else if (c > 0)
+                merge_children(p, c - 1);
+            else
+                merge_children(p, c);
+            n = p;
+        }
+        while (!mRoot->mLeaf && mRoot->mSize == 1) {
+            Inner *root = static_cast<Inner*>(mRoot);
+            mRoot = root->mChildren[0];
+            delete root;
+        }
+    }
+
+    void free_nodes(Node *n) {
+        if (n->mLeaf) {
+            delete static_cast<Leaf*>(n);
+            return;
+        }
+        Inner *in = static_cast<Inner*>(n);
+        for (unsigned int i = 0; i < in->mSize; i++)
+            free_nodes(in->mChildren[i]);
+        delete in;
+    }
+
+    template<typename K>
+    void zadd_generic(K &&key, ScoreType score, bool incr) {
+        Path path;
+        typename DictType::iterator it = mDict.find(key);
+        if (it != mDict.end()) {
+            ScoreType curscore = it->second;
+            if (incr) {
+                score += curscore;
+            }
+            if (score != curscore) {
+                find(curscore, key, path);
+                erase_at(path);
+                descend(NotAfter(score, key, mKeyCompare), &path);
+                insert_at(path, score, key);
+                it->second = score;
+            }
+            return;
+        }
+        descend(NotAfter(score, key, mKeyCompare), &path);
+        insert_at(path, score, key);
+        mDict.insert(std::make_pair(std::forward<K>(key), score));
+    }
+
+    /* Remove the elements of ranks [first, last). */
+    void erase_ranks(unsigned long first, unsigned long last) {
+        Path path;
+        for (; first < last; last--) {
+            locate(first, path);
+            mDict.erase(path.mLeaf->mKeys[path.mPos]);
+            erase_at(path);
+        }
+    }
+
+    void pop(bool max, KeyType &key, ScoreType &score) {
+        Path path;
+        locate(max ? zcard() - 1 : 0, path);
+        key = std::move(path.mLeaf->mKeys[path.mPos]);
+        score = path.mLeaf->mScores[path.mPos];
+        mDict.erase(key);
+        erase_at(path);
+    }
+
+    void zpop_generic(bool max, long count, KeyScoreVecType &result) {
+        result.clear();
+        if (count <= 0)
+            return;
+        result.resize(std::min((unsigned long)count, zcard()));
+        for (std::size_t i = 0; i < result.size(); i++)
+            pop(max, result[i].first, result[i].second);
+    }
+
+    static bool sanitize_rank_range(long &start, long &end, long llen) {
+        if (start < 0) start = llen+start;
+        if (end < 0) end = llen+end;
+        if (start < 0) start = 0;
+        if (start > end || start >= llen) {
+            return false;
+        }
+        if (end >= llen) end = llen-1;
+        return true;
+    }
+
+    /* The ranks [first, last) of a score range, in skiplist terms. */
+    void score_ranks(ScoreType min, ScoreType max, bool reverse, bool minex, bool maxex,
+                     unsigned long &first, unsigned long &last) const {
+        first = descend(ScoreBelow(reverse ? max : min, reverse ? maxex : minex), NULL);
+        last = descend(ScoreUpTo(reverse ? min : max, reverse ? minex : maxex), NULL);
+    }
+
+    void lex_ranks(const LexBound &min, const LexBound &max, unsigned long &first, unsigned long &last) const {
+        first = descend(LexBelow(min, mKeyCompare), NULL);
+        last = descend(LexUpTo(max, mKeyCompare), NULL);
+    }
+
+    /* Calls fn(key, score) on the elements of ranks [first, last), in
+     * reverse order if 'reverse', after skipping 'offset' of them and for
+     * at most 'count' (all if negative) of them. */
+    template<typename Fn>
+    void visit_ranks(unsigned long first, unsigned long last, bool reverse, Fn &fn,
+                     long offset = 0, long count = -1) const {
+        if (offset < 0 || first >= last || last - first <= (unsigned long)offset) {
+            return;
+        }
+        unsigned long n = last - first - offset;
+        if (count >= 0 && (unsigned long)count < n)
+            n = count;
+        Path path;
+        locate(reverse ? last - 1 - offset : first + offset, path);
+        const Leaf *l = path.mLeaf;
+        unsigned int pos = path.mPos;
+        while (n--) {
+            fn(l->mKeys[pos], l->mScores[pos]);
+            if (reverse) {
+                if (pos > 0) {
+                    pos--;
+                }
+                else if ((l = l->mPrev) != NULL) {
+                    pos = l->mSize - 1;
+                }
+            }
+            else if (++pos == l->mSize) {
+                l = l->mNext;
+                pos = 0;
+            }
+        }
+    }
+
+    template<typename Fn>
+    void zrange_generic(long start, long end, bool reverse, Fn &fn) const {
+        long llen = zcard();
+        if (!sanitize_rank_range(start, end, llen)) {
+            return;
+        }
+        if (reverse)
+            visit_ranks(llen - 1 - end, llen - start, true, fn);
+        else
+            visit_ranks(start, end + 1, false, fn);
+    }
+
+    template<typename Fn>
+    void zrangebyscore_generic(ScoreType min, ScoreType max, bool reverse, Fn &fn,
+                               bool minex, bool maxex, long offset = 0, long count = -1) const {
+        unsigned long first, last;
+        score_ranks(min, max, reverse, minex, maxex, first, last);
+        visit_ranks(first, last, reverse, fn, offset, count);
+    }
+
+    template<typename Fn>
+    void zrangebylex_generic(const LexBound &min, const LexBound &max, bool reverse, Fn &fn,
+                             long offset = 0, long count = -1) const {
+        unsigned long first, last;
+        lex_ranks(min, max, first, last);
+        visit_ranks(first, last, reverse, fn, offset, count);
+    }
+
+    class KeyCollector {
+    public:
+        KeyCollector(KeyVecType &result): mResult(result) { mResult.clear(); }
+        void operator()(const KeyType &key, ScoreType) { mResult.push_back(key); }
+    private:
+        KeyVecType &mResult;
+    };
+
+    class KeyScoreCollector {
+    public:
+        KeyScoreCollector(KeyScoreVecType &result): mResult(result) { mResult.clear(); }
+        void operator()(const KeyType &key, ScoreType score) { mResult.push_back(std::make_pair(key, score)); }
+    private:
+        KeyScoreVecType &mResult;
+    };
+
+    bool zrank_generic(const KeyType &key, bool reverse, unsigned long &rank) const {
+        typename DictType::const_iterator it = mDict.find(key);
+        if (it == mDict.end())
+            return false;
+        rank = count_before(it->second, key);
+        if (reverse)
+            rank = zcard() - 1 - rank;
+        return true;
+    }
+
+    const_iterator iterator_at(unsigned long rank) const {
+        if (rank >= zcard())
+            return end();
+        Path path;
+        locate(rank, path);
+        return const_iterator(path.mLeaf, path.mPos, this);
+    }
+
+    /* The reverse iterator on the element of rank 'rank', rend() for -1. */
+    const_reverse_iterator reverse_iterator_at(long rank) const {
+        if (rank < 0)
+            return rend();
+        Path path;
+        locate(rank, path);
+        return const_reverse_iterator(path.mLeaf, path.mPos, this);
+    }
+
+    RangeViewType view_of(unsigned long first, unsigned long last) const {
+        if (first >= last)
+            return RangeViewType(end(), end());
+        return RangeViewType(iterator_at(first), iterator_at(last));
+    }
+
+    ReverseRangeViewType reverse_view_of(unsigned long first, unsigned long last) const {
+        if (first >= last)
+            return ReverseRangeViewType(rend(), rend());
+        return ReverseRangeViewType(reverse_iterator_at(last - 1), reverse_iterator_at((long)first - 1));
+    }
+
+public:
+    BTreeSortedSet(): mRoot(new Leaf), mFirst(static_cast<Leaf*>(mRoot)), mLast(mFirst) {}
+
+    ~BTreeSortedSet() {
+        free_nodes(mRoot);
+    }
+
+    void zadd(const KeyType &key, ScoreType score) {
+        zadd_generic(key, score, false);
+    }
+
+    void zadd(KeyType &&key, ScoreType score) {
+        zadd_generic(std::move(key), score, false);
+    }
+
+    void zincrby(const KeyType &key, ScoreType score) {
+        zadd_generic(key, score, true);
+    }
+
+    void zincrby(KeyType &&key, ScoreType score) {
+        zadd_generic(std::move(key), score, true);
+    }
+
+    void zadd_many(const KeyScorePairType *items, std::size_t count) {
+        mDict.rehash(mDict.size() + count);
+        for (std::size_t i = 0; i < count; i++)
+            zadd_generic(items[i].first, items[i].second, false);
+    }
+
+    void zadd_many(const KeyScoreVecType &items) {
+        if (!items.empty())
+            zadd_many(&items[0], items.size());
+    }
+
+    void zrem_many(const KeyType *keys, std::size_t count) {
+        for (std::size_t i = 0; i < count; i++)
+            zrem(keys[i]);
+    }
+
+    void zrem_many(const KeyVecType &keys) {
+        if (!keys.empty())
+            zrem_many(&keys[0], keys.size());
+    }
+
+    void zrem(const KeyType &key) {
+        typename DictType::iterator it = mDict.find(key);
+        if (it != mDict.end()) {
+            Path path;
+            find(it->second, key, path);
+            mDict.erase(it);
+            erase_at(path);
+        }
+    }
+
+    void zremrangebyscore(ScoreType min, ScoreType max, bool minex = false, bool maxex = false) {
+        unsigned long first, last;
+        score_ranks(min, max, false, minex, maxex, first, last);
+        erase_ranks(first, last);
+    }
+
+    void zremrangebyrank(long start, long end) {
+        if (sanitize_rank_range(start, end, zcard()))
+            erase_ranks(start, end + 1);
+    }
+
+    void zremrangebylex(const LexBound &min, const LexBound &max) {
+        unsigned long first, last;
+        lex_ranks(min, max, first, last);
+        erase_ranks(first, last);
+    }
+
+    void zpopmin(long count, KeyScoreVecType &result) {
+        zpop_generic(false, count, result);
+    }
+
+    void zpopmax(long count, KeyScoreVecType &result) {
+        zpop_generic(true, count, result);
+    }
+
+    bool zpopmin(KeyType &key, ScoreType &score) {
+        if (zcard() == 0)
+            return false;
+        pop(false, key, score);
+        return true;
+    }
+
+    bool zpopmax(KeyType &key, ScoreType &score) {
+        if (zcard() == 0)
+            return false;
+        pop(true, key, score);
+        return true;
+    }
+
+    void zrange(long start, long end, KeyVecType &result) const {
+        KeyCollector collect(result);
+        zrange_generic(start, end, false, collect);
+    }
+
+    void zrevrange(long start, long end, KeyVecType &result) const {
+        KeyCollector collect(result);
+        zrange_generic(start, end, true, collect);
+    }
+
+    void zrange_withscores(long start, long end, KeyScoreVecType &result) const {
+        KeyScoreCollector collect(result);
+        zrange_generic(start, end, false, collect);
+    }
+
+    void zrevrange_withscores(long start, long end, KeyScoreVecType &result) const {
+        KeyScoreCollector collect(result);
+        zrange_generic(start, end, true, collect);
+    }
+
+    void zrangebyscore(ScoreType min, ScoreType max, KeyVecType &result, bool minex = false, bool maxex = false) const {
+        KeyCollector collect(result);
+        zrangebyscore_generic(min, max, false, collect, minex, maxex);
+    }
+
+    void zrevrangebyscore(ScoreType min, ScoreType max, KeyVecType &result, bool minex = false, bool maxex = false) const {
+        KeyCollector collect(result);
+        zrangebyscore_generic(min, max, true, collect, minex, maxex);
+    }
+
+    void zrangebyscore_withscores(ScoreType min, ScoreType max, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+        KeyScoreCollector collect(result);
+        zrangebyscore_generic(min, max, false, collect, minex, maxex);
+    }
+
+    void zrevrangebyscore_withscores(ScoreType min, ScoreType max, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+        KeyScoreCollector collect(result);
+        zrangebyscore_generic(min, max, true, collect, minex, maxex);
+    }
+
+    template<typename Fn>
+    void zrange(long start, long end, Fn fn) const {
+        zrange_generic(start, end, false, fn);
+    }
+
+    template<typename Fn>
+    void zrevrange(long start, long end, Fn fn) const {
+        zrange_generic(start, end, true, fn);
+    }
+
+    template<typename Fn>
+    void zrangebyscore(ScoreType min, ScoreType max, Fn fn, bool minex = false, bool maxex = false) const {
+        zrangebyscore_generic(min, max, false, fn, minex, maxex);
+    }
+
+    template<typename Fn>
+    void zrevrangebyscore(ScoreType min, ScoreType max, Fn fn, bool minex = false, bool maxex = false) const {
+        zrangebyscore_generic(min, max, true, fn, minex, maxex);
+    }
+
+    void zrangebyscore_limit(ScoreType min, ScoreType max, long offset, long count, KeyVecType &result, bool minex = false, bool maxex = false) const {
+        KeyCollector collect(result);
+        zrangebyscore_generic(min, max, false, collect, minex, maxex, offset, count);
+    }
+
+    void zrevrangebyscore_limit(ScoreType min, ScoreType max, long offset, long count, KeyVecType &result, bool minex = false, bool maxex = false) const {
+        KeyCollector collect(result);
+        zrangebyscore_generic(min, max, true, collect, minex, maxex, offset, count);
+    }
+
+    void zrangebyscore_withscores_limit(ScoreType min, ScoreType max, long offset, long count, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+        KeyScoreCollector collect(result);
+        zrangebyscore_generic(min, max, false, collect, minex, maxex, offset, count);
+    }
+
+    void zrevrangebyscore_withscores_limit(ScoreType min, ScoreType max, long offset, long count, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+        KeyScoreCollector collect(result);
+        zrangebyscore_generic(min, max, true, collect, minex, maxex, offset, count);
+    }
+
+    template<typename Fn>
+    void zrangebyscore_limit(ScoreType min, ScoreType max, long offset, long count, Fn fn, bool minex = false, bool maxex = false) const {
+        zrangebyscore_generic(min, max, false, fn, minex, maxex, offset, count);
+    }
+
+    template<typename Fn>
+    void zrevrangebyscore_limit(ScoreType min, ScoreType max, long offset, long count, Fn fn, bool minex = false, bool maxex = false) const {
+        zrangebyscore_generic(min, max, true, fn, minex, maxex, offset, count);
+    }
+
+    void zrangebylex(const LexBound &min, const LexBound &max, KeyVecType &result) const {
+        KeyCollector collect(result);
+        zrangebylex_generic(min, max, false, collect);
+    }
+
+    void zrevrangebylex(const LexBound &max, const LexBound &min, KeyVecType &result) const {
+        KeyCollector collect(result);
+        zrangebylex_generic(min, max, true, collect);
+    }
+
+    void zrangebylex_limit(const LexBound &min, const LexBound &max, long offset, long count, KeyVecType &result) const {
+        KeyCollector collect(result);
+        zrangebylex_generic(min, max, false, collect, offset, count);
+    }
+
+    void zrevrangebylex_limit(const LexBound &max, const LexBound &min, long offset, long count, KeyVecType &result) const {
+        KeyCollector collect(result);
+        zrangebylex_generic(min, max, true, collect, offset, count);
+    }
+
+    template<typename Fn>
+    void zrangebylex(const LexBound &min, const LexBound &max, Fn fn) const {
+        zrangebylex_generic(min, max, false, fn);
+    }
+
+    template<typename Fn>
+    void zrevrangebylex(const LexBound &max, const LexBound &min, Fn fn) const {
+        zrangebylex_generic(min, max, true, fn);
+    }
+
+    template<typename Fn>
+    void zrangebylex_limit(const LexBound &min, const LexBound &max, long offset, long count, Fn fn) const {
+        zrangebylex_generic(min, max, false, fn, offset, count);
+    }
+
+    template<typename Fn>
+    void zrevrangebylex_limit(const LexBound &max, const LexBound &min, long offset, long count, Fn fn) const {
+        zrangebylex_generic(min, max, true, fn, offset, count);
+    }
+
+    unsigned long zlexcount(const LexBound &min, const LexBound &max) const {
+        unsigned long first, last;
+        lex_ranks(min, max, first, last);
+        return (last > first) ? last - first : 0;
+    }
+
+    unsigned long zcount(ScoreType min, ScoreType max, bool minex = false, bool maxex = false) const {
+        unsigned long first, last;
+        score_ranks(min, max, false, minex, maxex, first, last);
+        return (last > first) ? last - first : 0;
+    }
+
+    unsigned long zcard() const {
+        return mDict.size();
+    }
+
+    bool zscore(const KeyType &key, ScoreType &score) const {
+        typename DictType::const_iterator it = mDict.find(key);
+        if (it == mDict.end())
+            return false;
+        score = it->second;
+        return true;
+    }
+
+    bool zrank(const KeyType &key, unsigned long &rank) const {
+        return zrank_generic(key, false, rank);
+    }
+
+    bool zrevrank(const KeyType &key, unsigned long &rank) const {
+        return zrank_generic(key, true, rank);
+    }
+
+    /* Number of elements sorting before (score, key), see SortedSet. */
+    unsigned long count_before(ScoreType score, const KeyType &key) const {
+        return descend(Before(score, key, mKeyCompare), NULL);
+    }
+
+    const_iterator begin() const {
+        return const_iterator(mFirst->mSize ? mFirst : NULL, 0, this);
+    }
+
+    const_iterator end() const {
+        return const_iterator(NULL, 0, this);
+    }
+
+    const_reverse_iterator rbegin() const {
+        return mLast->mSize ? const_reverse_iterator(mLast, mLast->mSize - 1, this) : rend();
+    }
+
+    const_reverse_iterator rend() const {
+        return const_reverse_iterator(NULL, 0, this);
+    }
+
+    RangeViewType zrange_view(long start, long end) const {
+        if (!sanitize_rank_range(start, end, zcard()))
+            return RangeViewType(this->end(), this->end());
+        return view_of(start, end + 1);
+    }
+
+    ReverseRangeViewType zrevrange_view(long start, long end) const {
+        long llen = zcard();
+        if (!sanitize_rank_range(start, end, llen))
+            return ReverseRangeViewType(rend(), rend());
+        return reverse_view_of(llen - 1 - end, llen - start);
+    }
+
+    RangeViewType zrangebyscore_view(ScoreType min, ScoreType max, bool minex = false, bool maxex = false) const {
+        unsigned long first, last;
+        score_ranks(min, max, false, minex, maxex, first, last);
+        return view_of(first, last);
+    }
+
+    ReverseRangeViewType zrevrangebyscore_view(ScoreType min, ScoreType max, bool minex = false, bool maxex = false) const {
+        unsigned long first, last;
+        score_ranks(min, max, true, minex, maxex, first, last);
+        return reverse_view_of(first, last);
+    }
+
+    RangeViewType zrangebylex_view(const LexBound &min, const LexBound &max) const {
+        unsigned long first, last;
+        lex_ranks(min, max, first, last);
+        return view_of(first, last);
+    }
+
+    ReverseRangeViewType zrevrangebylex_view(const LexBound &max, const LexBound &min) const {
+        unsigned long first, last;
+        lex_ranks(min, max, first, last);
+        return reverse_view_of(first, last);
+    }
+
+private:
+    BTreeSortedSet(const BTreeSortedSet&);
+    BTreeSortedSet& operator=(const BTreeSortedSet&);
+
+    Node *mRoot;
+    /* The ends of the doubly linked list of leaves. The first leaf is never
+     * freed: merges always drop the right hand node. */
+    Leaf *mFirst, *mLast;
+    DictType mDict;
+    KeyCompare mKeyCompare;
+};
+
+#endif
@@ -0,0 +1,769 @@
+/*******************************************************************************
+ *
+ *      @file: concurrent_sorted_set.hh
+ *
+ *      @brief: A thread safe Sorted Set, keeping two copies of a SortedSet
+ *              (left-right concurrency control). Read commands (zscore,
+ *              zrank, zcount, the range commands...) read the copy that is
+ *              published without any lock, so they never wait for writers
+ *              and run in parallel with each other and with writes on every
+ *              core. Write commands (zadd, zrem, zremrangeby*...) are
+ *              serialized by a lock, update the other copy, publish it, wait
+ *              for the readers of the old one to leave and update it too.
+ *
+ *      COPYRIGHT (C) 2013.
+ *
+ ******************************************************************************/
+#ifndef CONCURRENT_SORTEDSET_hh_INCLUDED
+#define CONCURRENT_SORTEDSET_hh_INCLUDED
+
+#include <pthread.h>
+#include <climits>
+#include <atomic>
+#include "sorted_set.hh"
+
+/* The lock prefers writers, so a steady flow of readers cannot starve them.
+ * The wrappers only hold it exclusively, to serialize their writers. */
+class SortedSetRWLock {
+public:
+    SortedSetRWLock() {
+        pthread_rwlockattr_t attr;
+        pthread_rwlockattr_init(&attr);
+        pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+        pthread_rwlock_init(&mLock, &attr);
+        pthread_rwlockattr_destroy(&attr);
+    }
+
+    ~SortedSetRWLock() {
+        pthread_rwlock_destroy(&mLock);
+    }
+
+    void lock_shared() { pthread_rwlock_rdlock(&mLock); }
+    void lock() { pthread_rwlock_wrlock(&mLock); }
+    void unlock() { pthread_rwlock_unlock(&mLock); }
+
+    class ReadGuard {
+    public:
+        ReadGuard(SortedSetRWLock &lock): mLock(lock) { mLock.lock_shared(); }
+        ~ReadGuard() { mLock.unlock(); }
+    private:
+        ReadGuard(const ReadGuard&);
+        ReadGuard& operator=(const ReadGuard&);
+        SortedSetRWLock &mLock;
+    };
+
+    class WriteGuard {
+    public:
+        WriteGuard(SortedSetRWLock &lock): mLock(lock) { mLock.lock(); }
+        ~WriteGuard() { mLock.unlock(); }
+    private:
+        WriteGuard(const WriteGuard&);
+        WriteGuard& operator=(const WriteGuard&);
+        SortedSetRWLock &mLock;
+    };
+
+private:
+    SortedSetRWLock(const SortedSetRWLock&);
+    SortedSetRWLock& operator=(const SortedSetRWLock&);
+
+    pthread_rwlock_t mLock;
+};
+
+/* Counts the readers of one copy of a set, spread over cache lines by
+ * thread so that readers on different cores do not fight over a counter.
+ * A writer waiting for the readers to leave spins for a short while, then
+ * sleeps until a reader leaving wakes it: the readers it waits for may be
+ * off the CPU, and a writer spinning or yielding would keep them there. */
+class SortedSetReadIndicator {
+public:
+    static const std::size_t SLOTS = 16;
+
+    SortedSetReadIndicator(): mWaiting(false) {
+        for (std::size_t i = 0; i < SLOTS; i++)
+            mSlots[i].mCount.store(0, std::memory_order_relaxed);
+        pthread_mutex_init(&mMutex, NULL);
+        pthread_cond_init(&mCond, NULL);
+    }
+
+    ~SortedSetReadIndicator() {
+        pthread_cond_destroy(&mCond);
+        pthread_mutex_destroy(&mMutex);
+    }
+
+    void arrive(std::size_t slot) { mSlots[slot].mCount.fetch_add(1); }
+
+    void depart(std::size_t slot) {
+        if (mSlots[slot].mCount.fetch_sub(1) == 1 && mWaiting.load()) {
+            pthread_mutex_lock(&mMutex);
+            pthread_cond_broadcast(&mCond);
+            pthread_mutex_unlock(&mMutex);
+        }
+    }
+
+    /* Wait until every reader has left. One waiter at a time. */
+    void wait_empty() {
+        for (int spins = 0; spins < WAIT_SPINS; spins++) {
+            if (empty())
+                return;
+        }
+        pthread_mutex_lock(&mMutex);
+        mWaiting.store(true);
+        while (!empty())
+            pthread_cond_wait(&mCond, &mMutex);
+        mWaiting.store(false);
+        pthread_mutex_unlock(&mMutex);
+    }
+
+    bool empty() const {
+        for (std::size_t i = 0; i < SLOTS; i++) {
+            if (mSlots[i].mCount.load() != 0)
+                return false;
+        }
+        return true;
+    }
+
+    /* The slot of the calling thread. */
+    static std::size_t slot() {
+        unsigned long long h = (unsigned long long)pthread_self();
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return (std::size_t)(h % SLOTS);
+    }
+
+private:
+    SortedSetReadIndicator(const SortedSetReadIndicator&);
+    SortedSetReadIndicator& operator=(const SortedSetReadIndicator&);
+
+    static const int WAIT_SPINS = 100;
+
+    /* Padded rather than aligned: new does not honour extended alignments
+     * before C++17. */
+    class Slot {
+    public:
+        std::atomic<long> mCount;
+        char mPad[64 - sizeof(std::atomic<long>)];
+    };
+
+    Slot mSlots[SLOTS];
+    /* Set while a writer sleeps on mCond. */
+    std::atomic<bool> mWaiting;
+    pthread_mutex_t mMutex;
+    pthread_cond_t mCond;
+};
+
+/* How the left-right copies handle expiring members: writes must not read
+ * the clock on their own, or the two copies could reclaim different
+ * members, so the writer reads it once and both copies reclaim up to the
+ * same time. Sets without expiry (BTreeSortedSet) have nothing to do. */
+template<typename SetType>
+class SortedSetExpiry {
+public:
+    static void init(SetType &) {}
+    static unsigned long long clock(const SetType &) { return 0; }
+    static void reclaim(SetType &, unsigned long long) {}
+};
+
+template<typename KeyType, typename HashFn, typename EqualKey, typename Allocator,
+         typename KeyCompare, typename ScoreType, typename SpanType, bool CacheScores, typename Instrument>
+class SortedSetExpiry< SortedSet<KeyType, HashFn, EqualKey, Allocator, KeyCompare, ScoreType, SpanType, CacheScores, Instrument> > {
+    typedef SortedSet<KeyType, HashFn, EqualKey, Allocator, KeyCompare, ScoreType, SpanType, CacheScores, Instrument> SetType;
+public:
+    static void init(SetType &set) { set.set_expire_batch(0); }
+
+    /* 0 when no member has an expiry time, so the clock is not read. */
+    static unsigned long long clock(const SetType &set) {
+        return set.expire_pending(ULLONG_MAX) ? SetType::now_ms() : 0;
+    }
+
+    static void reclaim(SetType &set, unsigned long long now) {
+        if (now != 0 && set.expire_pending(now))
+            set.expire_step(SetType::EXPIRE_BATCH, now);
+    }
+};
+
+/* Two copies of a set, read without locks: readers announce themselves on
+ * the read indicator of the current version, then read the published copy.
+ * A writer updates the copy nobody reads, publishes it, waits until the
+ * readers of both versions have moved on (toggling the version between the
+ * two waits, so new readers cannot keep it waiting) and applies the same
+ * update to the old copy. Readers never wait; writers wait for the reads
+ * in progress, not for new ones. Every write costs twice and the set takes
+ * twice the memory. Writers must be serialized by the caller, and an update
+ * op(SetType &set, bool last) runs on both copies, last telling which run
+ * it is (so keys may be moved from on the last one only); it must do the
+ * same on both. */
+template<typename SetType>
+class SortedSetLeftRight {
+public:
+    SortedSetLeftRight(): mLeftRight(0), mVersion(0) {
+        SortedSetExpiry<SetType>::init(mSets[0]);
+        SortedSetExpiry<SetType>::init(mSets[1]);
+    }
+
+    /* Start reading: returns the version to depart() from, 'set' is the
+     * copy to read until then. */
+    int arrive(std::size_t slot, const SetType *&set) const {
+        int version = mVersion.load();
+        mReaders[version].arrive(slot);
+        set = &mSets[mLeftRight.load()];
+        return version;
+    }
+
+    void depart(int version, std::size_t slot) const {
+        mReaders[version].depart(slot);
+    }
+
+    class ReadGuard {
+    public:
+        ReadGuard(const SortedSetLeftRight &sets): mSets(sets), mSlot(SortedSetReadIndicator::slot()) {
+            mVersion = mSets.arrive(mSlot, mSet);
+        }
+        ~ReadGuard() { mSets.depart(mVersion, mSlot); }
+        const SetType& set() const { return *mSet; }
+    private:
+        ReadGuard(const ReadGuard&);
+        ReadGuard& operator=(const ReadGuard&);
+        const SortedSetLeftRight &mSets;
+        const SetType *mSet;
+        std::size_t mSlot;
+        int mVersion;
+    };
+
+    /* The published copy, for the writer: both copies are alike between
+     * writes. */
+    const SetType& current() const {
+        return mSets[mLeftRight.load(std::memory_order_relaxed)];
+    }
+
+    /* 0 or 1, which copy 'set' is. */
+    std::size_t index_of(const SetType &set) const {
+        return (&set == &mSets[0]) ? 0 : 1;
+    }
+
+    /* Apply op to both copies. With 'reclaim', expired members are reclaimed
+     * first, as SortedSet's zadd/zincrby/zrem do. */
+    template<typename Op>
+    void write(const Op &op, bool reclaim = false) {
+        int published = mLeftRight.load(std::memory_order_relaxed);
+        unsigned long long now = reclaim ? SortedSetExpiry<SetType>::clock(mSets[published]) : 0;
+        SortedSetExpiry<SetType>::reclaim(mSets[!published], now);
+        op(mSets[!published], false);
+        mLeftRight.store(!published);
+        int version = mVersion.load(std::memory_order_relaxed);
+        wait(!version);
+        mVersion.store(!version);
+        wait(version);
+        SortedSetExpiry<SetType>::reclaim(mSets[published], now);
+        op(mSets[published], true);
+    }
+
+private:
+    SortedSetLeftRight(const SortedSetLeftRight&);
+    SortedSetLeftRight& operator=(const SortedSetLeftRight&);
+
+    void wait(int version) {
+        mReaders[version].wait_empty();
+    }
+
+    SetType mSets[2];
+    /* The published copy, and the version readers announce themselves on */
+    std::atomic<int> mLeftRight, mVersion;
+    mutable SortedSetReadIndicator mReaders[2];
+};
+
+/* Same commands as SortedSet, on SortedSetLeftRight copies. Iterators and
+ * views cannot outlive a read, so they are only reachable through read(),
+ * which runs a function on the published copy; write() runs one on both
+ * copies with the writers' lock held, for compound updates which must be
+ * atomic. Visitors of the range commands run during a read, they must not
+ * call back into the set: a write from a reader would wait for itself. */
+template< typename KeyType,
+          typename SetType = SortedSet<KeyType> >
+class ConcurrentSortedSet {
+public:
+    typedef typename SetType::KeyVecType KeyVecType;
+    typedef typename SetType::KeyScorePairType KeyScorePairType;
+    typedef typename SetType::KeyScoreVecType KeyScoreVecType;
+    typedef typename SetType::score_type ScoreType;
+    typedef typename SetType::LexBound LexBound;
+    typedef typename SortedSetLeftRight<SetType>::ReadGuard ReadGuard;
+    typedef SortedSetRWLock::WriteGuard WriteGuard;
+
+private:
+    template<typename Op>
+    void write_op(const Op &op, bool reclaim = false) {
+        WriteGuard guard(mLock);
+        mSets.write(op, reclaim);
+    }
+
+public:
+    void zadd(const KeyType &key, ScoreType score) {
+        write_op([&](SetType &set, bool) { set.zadd(key, score); }, true);
+    }
+
+    void zadd(KeyType &&key, ScoreType score) {
+        write_op([&](SetType &set, bool last) { if (last) set.zadd(std::move(key), score); else set.zadd(key, score); }, true);
+    }
+
+    void zincrby(const KeyType &key, ScoreType score) {
+        write_op([&](SetType &set, bool) { set.zincrby(key, score); }, true);
+    }
+
+    void zincrby(KeyType &&key, ScoreType score) {
+        write_op([&](SetType &set, bool last) { if (last) set.zincrby(std::move(key), score); else set.zincrby(key, score); }, true);
+    }
+
+    void zadd_many(const KeyScorePairType *items, std::size_t count) {
+        write_op([&](SetType &set, bool) { set.zadd_many(items, count); });
+    }
+
+    void zadd_many(const KeyScoreVecType &items) {
+        write_op([&](SetType &set, bool) { set.zadd_many(items); });
+    }
+
+    void zrem_many(const KeyType *keys, std::size_t count) {
+        write_op([&](SetType &set, bool) { set.zrem_many(keys, count); });
+    }
+
+    void zrem_many(const KeyVecType &keys) {
+        write_op([&](SetType &set, bool) { set.zrem_many(keys); });
+    }
+
+    void zrem(const KeyType &key) {
+        write_op([&](SetType &set, bool) { set.zrem(key); }, true);
+    }
+
+    void zpopmin(long count, KeyScoreVecType &result) {
+        write_op([&](SetType &set, bool) { set.zpopmin(count, result); });
+    }
+
+    void zpopmax(long count, KeyScoreVecType &result) {
+        write_op([&](SetType &set, bool) { set.zpopmax(count, result); });
+    }
+
+    bool zpopmin(KeyType &key, ScoreType &score) {
+        bool result;
+        write_op([&](SetType &set, bool) { result = set.zpopmin(key, score); });
+        return result;
+    }
+
+    bool zpopmax(KeyType &key, ScoreType &score) {
+        bool result;
+        write_op([&](SetType &set, bool) { result = set.zpopmax(key, score); });
+        return result;
+    }
+
+    bool pexpireat(const KeyType &key, unsigned long long when) {
+        bool result;
+        write_op([&](SetType &set, bool) { result = set.pexpireat(key, when); });
+        return result;
+    }
+
+    bool pexpire(const KeyType &key, unsigned long long ttl) {
+        bool result;
+        unsigned long long when = SetType::now_ms() + ttl;
+        write_op([&](SetType &set, bool) { result = set.pexpireat(key, when); });
+        return result;
+    }
+
+    bool persist(const KeyType &key) {
+        bool result;
+        write_op([&](SetType &set, bool) { result = set.persist(key); });
+        return result;
+    }
+
+    /* Reclaiming expired members holds the writers' lock, 'budget' bounds
+     * how long other writers wait for it. Readers do not wait at all. */
+    std::size_t expire_step(std::size_t budget) {
+        return expire_step(budget, SetType::now_ms());
+    }
+
+    std::size_t expire_step(std::size_t budget, unsigned long long now) {
+        std::size_t result;
+        write_op([&](SetType &set, bool) { result = set.expire_step(budget, now); });
+        return result;
+    }
+
+    void zremrangebyscore(ScoreType min, ScoreType max, bool minex = false, bool maxex = false) {
+        write_op([&](SetType &set, bool) { set.zremrangebyscore(min, max, minex, maxex); });
+    }
+
+    void zremrangebyrank(long start, long end) {
+        write_op([&](SetType &set, bool) { set.zremrangebyrank(start, end); });
+    }
+
+    void zremrangebylex(const LexBound &min, const LexBound &max) {
+        write_op([&](SetType &set, bool) { set.zremrangebylex(min, max); });
+    }
+
+    void zrange(long start, long end, KeyVecType &result) const {
+        ReadGuard guard(mSets);
+        guard.set().zrange(start, end, result);
+    }
+
+    void zrevrange(long start, long end, KeyVecType &result) const {
+        ReadGuard guard(mSets);
+        guard.set().zrevrange(start, end, result);
+    }
+
+    void zrange_withscores(long start, long end, KeyScoreVecType &result) const {
+        ReadGuard guard(mSets);
+        guard.set().zrange_withscores(start, end, result);
+    }
+
+    void zrevrange_withscores(long start, long end, KeyScoreVecType &result) const {
+        ReadGuard guard(mSets);
+        guard.set().zrevrange_withscores(start, end, result);
+    }
+
+    void zrangebyscore(ScoreType min, ScoreType max, KeyVecType &result, bool minex = false, bool maxex = false) const {
+        ReadGuard guard(mSets);
+        guard.set().zrangebyscore(min, max, result, minex, maxex);
+    }
+
+    void zrevrangebyscore(ScoreType min, ScoreType max, KeyVecType &result, bool minex = false, bool maxex = false) const {
+        ReadGuard guard(mSets);
+        guard.set().zrevrangebyscore(min, max, result, minex, maxex);
+    }
+
+    void zrangebyscore_withscores(ScoreType min, ScoreType max, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+        ReadGuard guard(mSets);
+        guard.set().zrangebyscore_withscores(min, max, result, minex, maxex);
+    }
+
+    void zrevrangebyscore_withscores(ScoreType min, ScoreType max, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+        ReadGuard guard(mSets);
+        guard.set().zrevrangebyscore_withscores(min, max, result, minex, maxex);
+    }
+
+    template<typename Fn>
+    void zrange(long start, long end, Fn fn) const {
+        ReadGuard guard(mSets);
+        guard.set().zrange(start, end, fn);
+    }
+
+    template<typename Fn>
+    void zrevrange(long start, long end, Fn fn) const {
+        ReadGuard guard(mSets);
+        guard.set().zrevrange(start, end, fn);
+    }
+
+    template<typename Fn>
+    void zrangebyscore(ScoreType min, ScoreType max, Fn fn, bool minex = false, bool maxex = false) const {
+        ReadGuard guard(mSets);
+        guard.set().zrangebyscore(min, max, fn, minex, maxex);
+    }
+
+    template<typename Fn>
+    void zrevrangebyscore(ScoreType min, ScoreType max, Fn fn, bool minex = false, bool maxex = false) const {
+        ReadGuard guard(mSets);
+        guard.set().zrevrangebyscore(min, max, fn, minex, maxex);
+    }
+
+    void zrangebyscore_limit(ScoreType min, ScoreType max, long offset, long count, KeyVecType &result, bool minex = false, bool maxex = false) const {
+        ReadGuard guard(mSets);
+        guard.set().zrangebyscore_limit(min, max, offset, count, result, minex, maxex);
+    }
+
+    void zrevrangebyscore_limit(ScoreType min, ScoreType max, long offset, long count, KeyVecType &result, bool minex = false, bool maxex = false) const {
+        ReadGuard guard(mSets);
+        guard.set().zrevrangebyscore_limit(min, max, offset, count, result, minex, maxex);
+    }
+
+    void zrangebyscore_withscores_limit(ScoreType min, ScoreType max, long offset, long count, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+        ReadGuard guard(mSets);
+        guard.set().zrangebyscore_withscores_limit(min, max, offset, count, result, minex, maxex);
+    }
+
+    void zrevrangebyscore_withscores_limit(ScoreType min, ScoreType max, long offset, long count, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+        ReadGuard guard(mSets);
+        guard.set().zrevrangebyscore_withscores_limit(min, max, offset, count, result, minex, maxex);
+    }
+
+    template<typename Fn>
+    void zrangebyscore_limit(ScoreType min, ScoreType max, long offset, long count, Fn fn, bool minex = false, bool maxex = false) const {
+        ReadGuard guard(mSets);
+        guard.set().zrangebyscore_limit(min, max, offset, count, fn, minex, maxex);
+    }
+
+    template<typename Fn>
+    void zrevrangebyscore_limit(ScoreType min, ScoreType max, long offset, long count, Fn fn, bool minex = false, bool maxex = false) const {
+        ReadGuard guard(mSets);
+        guard.set().zrevrangebyscore_limit(min, max, offset, count, fn, minex, maxex);
+    }
+
+    void zrangebylex(const LexBound &min, const LexBound &max, KeyVecType &result) const {
+        ReadGuard guard(mSets);
+        guard.set().zrangebylex(min, max, result);
+    }
+
+    void zrevrangebylex(const LexBound &max, const LexBound &min, KeyVecType &result) const {
+        ReadGuard guard(mSets);
+        guard.set().zrevrangebylex(max, min, result);
+    }
+
+    void zrangebylex_limit(const LexBound &min, const LexBound &max, long offset, long count, KeyVecType &result) const {
+        ReadGuard guard(mSets);
+        guard.set().zrangebylex_limit(min, max, offset, count, result);
+    }
+
+    void zrevrangebylex_limit(const LexBound &max, const LexBound &min, long offset, long count, KeyVecType &result) const {
+        ReadGuard guard(mSets);
+        guard.set().zrevrangebylex_limit(max, min, offset, count, result);
+    }
+
+    template<typename Fn>
+    void zrangebylex(const LexBound &min, const LexBound &max, Fn fn) const {
+        ReadGuard guard(mSets);
+        guard.set().zrangebylex(min, max, fn);
+    }
+
+    template<typename Fn>
+    void zrevrangebylex(const LexBound &max, const LexBound &min, Fn fn) const {
+        ReadGuard guard(mSets);
+        guard.set().zrevrangebylex(max, min, fn);
+    }
+
+    template<typename Fn>
+    void zrangebylex_limit(const LexBound &min, const LexBound &max, long offset, long count, Fn fn) const {
+        ReadGuard guard(mSets);
+        guard.set().zrangebylex_limit(min, max, offset, count, fn);
+    }
+
+    template<typename Fn>
+    void zrevrangebylex_limit(const LexBound &max, const LexBound &min, long offset, long count, Fn fn) const {
+        ReadGuard guard(mSets);
+        guard.set().zrevrangebylex_limit(max, min, offset, count, fn);
+    }
+
+    unsigned long zlexcount(const LexBound &min, const LexBound &max) const {
+        ReadGuard guard(mSets);
+        return guard.set().zlexcount(min, max);
+    }
+
+    unsigned long zcount(ScoreType min, ScoreType max, bool minex = false, bool maxex = false) const {
+        ReadGuard guard(mSets);
+        return guard.set().zcount(min, max, minex, maxex);
+    }
+
+    unsigned long zcard() const {
+        ReadGuard guard(mSets);
+        return guard.set().zcard();
+    }
+
+    bool zscore(const KeyType &key, ScoreType &score) const {
+        ReadGuard guard(mSets);
+        return guard.set().zscore(key, score);
+    }
+
+    bool pexpiretime(const KeyType &key, unsigned long long &when) const {
+        ReadGuard guard(mSets);
+        return guard.set().pexpiretime(key, when);
+    }
+
+    bool expire_pending(unsigned long long now) const {
+        ReadGuard guard(mSets);
+        return guard.set().expire_pending(now);
+    }
+
+    bool zrank(const KeyType &key, unsigned long &rank) const {
+        ReadGuard guard(mSets);
+        return guard.set().zrank(key, rank);
+    }
+
+    bool zrevrank(const KeyType &key, unsigned long &rank) const {
+        ReadGuard guard(mSets);
+        return guard.set().zrevrank(key, rank);
+    }
+
+    bool save(std::ostream &os, bool checksum = true) const {
+        ReadGuard guard(mSets);
+        return guard.set().save(os, checksum);
+    }
+
+    bool save_file(const char *path, bool checksum = true) const {
+        ReadGuard guard(mSets);
+        return guard.set().save_file(path, checksum);
+    }
+
+    bool load(const char *data, std::size_t size) {
+        bool result;
+        write_op([&](SetType &set, bool) { result = set.load(data, size); });
+        return result;
+    }
+
+    bool load_file(const char *path) {
+        bool result;
+        write_op([&](SetType &set, bool) { result = set.load_file(path); });
+        return result;
+    }
+
+    /* A frozen view of the set, see SortedSet::FrozenView: one on each copy,
+     * created and destroyed as updates of both. The commands of the view
+     * read the one of the published copy without any lock, so writers run
+     * while a long scan pages through the view. */
+    class FrozenView {
+    public:
+        FrozenView(ConcurrentSortedSet &set): mOwner(set) {
+            mViews[0] = mViews[1] = NULL;
+            mOwner.write_op(Create(*this));
+        }
+
+        ~FrozenView() {
+            mOwner.write_op(Destroy(*this));
+        }
+
+        void zrange(long start, long end, KeyVecType &result) const {
+            ReadGuard guard(mOwner.mSets);
+            view(guard).zrange(start, end, result);
+        }
+
+        void zrevrange(long start, long end, KeyVecType &result) const {
+            ReadGuard guard(mOwner.mSets);
+            view(guard).zrevrange(start, end, result);
+        }
+
+        void zrange_withscores(long start, long end, KeyScoreVecType &result) const {
+            ReadGuard guard(mOwner.mSets);
+            view(guard).zrange_withscores(start, end, result);
+        }
+
+        void zrevrange_withscores(long start, long end, KeyScoreVecType &result) const {
+            ReadGuard guard(mOwner.mSets);
+            view(guard).zrevrange_withscores(start, end, result);
+        }
+
+        void zrangebyscore(ScoreType min, ScoreType max, KeyVecType &result, bool minex = false, bool maxex = false) const {
+            ReadGuard guard(mOwner.mSets);
+            view(guard).zrangebyscore(min, max, result, minex, maxex);
+        }
+
+        void zrevrangebyscore(ScoreType min, ScoreType max, KeyVecType &result, bool minex = false, bool maxex = false) const {
+            ReadGuard guard(mOwner.mSets);
+            view(guard).zrevrangebyscore(min, max, result, minex, maxex);
+        }
+
+        void zrangebyscore_withscores(ScoreType min, ScoreType max, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+            ReadGuard guard(mOwner.mSets);
+            view(guard).zrangebyscore_withscores(min, max, result, minex, maxex);
+        }
+
+        void zrevrangebyscore_withscores(ScoreType min, ScoreType max, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+            ReadGuard guard(mOwner.mSets);
+            view(guard).zrevrangebyscore_withscores(min, max, result, minex, maxex);
+        }
+
+        template<typename Fn>
+        void zrange(long start, long end, Fn fn) const {
+            ReadGuard guard(mOwner.mSets);
+            view(guard).zrange(start, end, fn);
+        }
+
+        template<typename Fn>
+        void zrevrange(long start, long end, Fn fn) const {
+            ReadGuard guard(mOwner.mSets);
+            view(guard).zrevrange(start, end, fn);
+        }
+
+        template<typename Fn>
+        void zrangebyscore(ScoreType min, ScoreType max, Fn fn, bool minex = false, bool maxex = false) const {
+            ReadGuard guard(mOwner.mSets);
+            view(guard).zrangebyscore(min, max, fn, minex, maxex);
+        }
+
+        template<typename Fn>
+        void zrevrangebyscore(ScoreType min, ScoreType max, Fn fn, bool minex = false, bool maxex = false) const {
+            ReadGuard guard(mOwner.mSets);
+            view(guard).zrevrangebyscore(min, max, fn, minex, maxex);
+        }
+
+        unsigned long zcount(ScoreType min, ScoreType max, bool minex = false, bool maxex = false) const {
+            ReadGuard guard(mOwner.mSets);
+            return view(guard).zcount(min, max, minex, maxex);
+        }
+
+        unsigned long zcard() const {
+            ReadGuard guard(mOwner.mSets);
+            return view(guard).zcard();
+        }
+
+        bool zscore(const KeyType &key, ScoreType &score) const {
+            ReadGuard guard(mOwner.mSets);
+            return view(guard).zscore(key, score);
+        }
+
+        bool zrank(const KeyType &key, unsigned long &rank) const {
+            ReadGuard guard(mOwner.mSets);
+            return view(guard).zrank(key, rank);
+        }
+
+        bool zrevrank(const KeyType &key, unsigned long &rank) const {
+            ReadGuard guard(mOwner.mSets);
+            return view(guard).zrevrank(key, rank);
+        }
+
+    private:
+        FrozenView(const FrozenView&);
+        FrozenView& operator=(const FrozenView&);
+
+        class Create {
+        public:
+            Create(FrozenView &view): mView(view) {}
+            void operator()(SetType &set, bool) const {
+                mView.mViews[mView.mOwner.mSets.index_of(set)] = new typename SetType::FrozenView(set);
+            }
+        private:
+            FrozenView &mView;
+        };
+
+        class Destroy {
+        public:
+            Destroy(FrozenView &view): mView(view) {}
+            void operator()(SetType &set, bool) const {
+                delete mView.mViews[mView.mOwner.mSets.index_of(set)];
+            }
+        private:
+            FrozenView &mView;
+        };
+
+        const typename SetType::FrozenView& view(const ReadGuard &guard) const {
+            return *mViews[mOwner.mSets.index_of(guard.set())];
+        }
+
+        ConcurrentSortedSet &mOwner;
+        typename SetType::FrozenView *mViews[2];
+    };
+
+    /* fn(const SetType&) on the published copy, without waiting for writers. */
+    template<typename Fn>
+    void read(Fn fn) const {
+        ReadGuard guard(mSets);
+        fn(guard.set());
+    }
+
+    /* fn(SetType&) on both copies in turn, with the writers' lock held: it
+     * must make the same changes to both. */
+    template<typename Fn>
+    void write(Fn fn) {
+        WriteGuard guard(mLock);
+        mSets.write(Update<Fn>(fn));
+    }
+
+private:
+    /* Adapts fn(SetType&) to SortedSetLeftRight::write(). */
+    template<typename Fn>
+    class Update {
+    public:
+        Update(Fn &fn): mFn(fn) {}
+        void operator()(SetType &set, bool) const { mFn(set); }
+    private:
+        Fn &mFn;
+    };
+
+    SortedSetLeftRight<SetType> mSets;
+    /* Serializes the writers */
+    SortedSetRWLock mLock;
+};
+
+#endif
@@ -73,5 +73,17 @@ int main()
     std::for_each(result.begin(), result.end(), echo_ranking);
     std::cout << std::endl;
 
+    /* Sessions coming and going: removed members take their expiry time
+     * along, the set does not keep growing. */
+    SortedSet<int> sessions;
+    std::size_t empty = sessions.memory_usage();
+    for (int i = 0; i < 100000; i++) {
+        sessions.zadd(i, i);
+        sessions.pexpireat(i, SortedSet<int>::now_ms() + 1000000000ULL);
+        sessions.zrem(i);
+    }
+    std::cout << sessions.zcard() << " "
+              << (sessions.memory_usage() < empty + 4096 ? "no leak" : "leak") << std::endl;
+
     return 0;
 }
@@ -0,0 +1,844 @@
+/*******************************************************************************
+ *
+ *      @file: sharded_sorted_set.hh
+ *
+ *      @brief: A Sorted Set split into independent SortedSet shards, each one
+ *              kept in left-right copies (see concurrent_sorted_set.hh):
+ *              reads take no lock, writes only lock the writers of their
+ *              shard. Keys are hashed to their shard, so zadd/zincrby/zrem/
+ *              zscore only touch one shard and updates of different shards
+ *              run in parallel.
+ *              Commands about the whole ordering scatter to every shard and
+ *              gather the results: zcount and zcard sum the shards, zrank
+ *              sums how many elements of every shard sort before the member,
+ *              and the range commands k-way merge the shards from their
+ *              own share of the offset.
+ *
+ *      COPYRIGHT (C) 2013.
+ *
+ ******************************************************************************/
+#ifndef SHARDED_SORTEDSET_hh_INCLUDED
+#define SHARDED_SORTEDSET_hh_INCLUDED
+
+#include <climits>
+#include <atomic>
+#include "concurrent_sorted_set.hh"
+
+/* Reads never wait for writers. Writes spanning several shards lock the
+ * writers of all of them, always in index order, so they cannot deadlock
+ * with each other; single shard writes only take one lock. A read of
+ * several shards may see a multi shard write on some shards only. */
+template< typename KeyType,
+          typename SetType = SortedSet<KeyType> >
+class ShardedSortedSet {
+public:
+    typedef typename SetType::KeyVecType KeyVecType;
+    typedef typename SetType::KeyScorePairType KeyScorePairType;
+    typedef typename SetType::KeyScoreVecType KeyScoreVecType;
+    typedef typename SetType::score_type ScoreType;
+    typedef typename SetType::LexBound LexBound;
+private:
+    typedef typename SetType::hasher HashFn;
+    typedef typename SetType::key_compare KeyCompare;
+    typedef typename SortedSetLeftRight<SetType>::ReadGuard ReadGuard;
+    typedef SortedSetRWLock::WriteGuard WriteGuard;
+
+    /* The set of a shard is kept in SortedSetLeftRight copies, read without
+     * locks; the lock only serializes the writers of the shard. */
+    class Shard {
+    public:
+        SortedSetLeftRight<SetType> mSets;
+        mutable SortedSetRWLock mLock;
+    };
+
+    /* The copies of the shards a multi shard command works on. */
+    class ShardSets {
+    public:
+        const SetType& operator[](std::size_t i) const { return *mSets[i]; }
+    protected:
+        std::vector<const SetType*> mSets;
+    };
+
+    /* Reads every shard for the lifetime of the guard, without waiting for
+     * their writers. The shards are not read at one point in time: a write
+     * of another shard may land between the reads of two shards. */
+    class ReadAllGuard: public ShardSets {
+    public:
+        ReadAllGuard(const ShardedSortedSet &set)
+            : mSet(set), mSlot(SortedSetReadIndicator::slot()), mVersions(set.mCount) {
+            this->mSets.resize(mSet.mCount);
+            for (std::size_t i = 0; i < mSet.mCount; i++)
+                mVersions[i] = mSet.mShards[i].mSets.arrive(mSlot, this->mSets[i]);
+        }
+        ~ReadAllGuard() {
+            for (std::size_t i = 0; i < mSet.mCount; i++)
+                mSet.mShards[i].mSets.depart(mVersions[i], mSlot);
+        }
+    private:
+        ReadAllGuard(const ReadAllGuard&);
+        ReadAllGuard& operator=(const ReadAllGuard&);
+        const ShardedSortedSet &mSet;
+        std::size_t mSlot;
+        std::vector<int> mVersions;
+    };
+
+    /* Locks the writers of every shard, always in index order, so that
+     * multi shard writes cannot deadlock with each other. */
+    class WriteAllGuard: public ShardSets {
+    public:
+        WriteAllGuard(ShardedSortedSet &set): mSet(set) {
+            for (std::size_t i = 0; i < mSet.mCount; i++) {
+                mSet.mShards[i].mLock.lock();
+                this->mSets.push_back(&mSet.mShards[i].mSets.current());
+            }
+        }
+        ~WriteAllGuard() {
+            for (std::size_t i = mSet.mCount; i > 0; i--)
+                mSet.mShards[i-1].mLock.unlock();
+        }
+    private:
+        WriteAllGuard(const WriteAllGuard&);
+        WriteAllGuard& operator=(const WriteAllGuard&);
+        ShardedSortedSet &mSet;
+    };
+
+    /* Where a k-way merge stands in one shard. */
+    template<typename Iterator>
+    class Cursor {
+    public:
+        Cursor(Iterator cur, Iterator end, std::size_t shard): mCur(cur), mEnd(end), mShard(shard) {}
+        Iterator mCur, mEnd;
+        std::size_t mShard;
+    };
+
+    /* Heap order of the merge: true when 'a' must come out after 'b'. */
+    template<typename Iterator>
+    class CursorAfter {
+    public:
+        CursorAfter(bool reverse): mReverse(reverse) {}
+        bool operator()(const Cursor<Iterator> &a, const Cursor<Iterator> &b) const {
+            return mReverse ? before(a, b) : before(b, a);
+        }
+    private:
+        bool before(const Cursor<Iterator> &a, const Cursor<Iterator> &b) const {
+            return a.mCur.score() < b.mCur.score() ||
+                   (a.mCur.score() == b.mCur.score() && mKeyCompare(*a.mCur, *b.mCur));
+        }
+        bool mReverse;
+        KeyCompare mKeyCompare;
+    };
+
+    /* Merge the cursors in set order (reversed if reverse), skip the first
+     * 'skip' elements, then call fn(shard, iterator) on the next 'count'. */
+    template<typename Iterator, typename Fn>
+    static void merge(std::vector< Cursor<Iterator> > &heap, bool reverse,
+                      unsigned long skip, unsigned long count, Fn &fn) {
+        CursorAfter<Iterator> after(reverse);
+        std::make_heap(heap.begin(), heap.end(), after);
+        while (!heap.empty() && count > 0) {
+            std::pop_heap(heap.begin(), heap.end(), after);
+            Cursor<Iterator> &c = heap.back();
+            if (skip > 0) {
+                skip--;
+            }
+            else {
+                fn(c.mShard, c.mCur);
+                count--;
+            }
+            if (++c.mCur == c.mEnd)
+                heap.pop_back();
+            else
+                std::push_heap(heap.begin(), heap.end(), after);
+        }
+    }
+
+    /* Adapts fn(key, score) visitors to merge(). */
+    template<typename Fn>
+    class ElementVisitor {
+    public:
+        ElementVisitor(Fn &fn): mFn(fn) {}
+        template<typename Iterator>
+        void operator()(std::size_t, const Iterator &it) { mFn(*it, it.score()); }
+    private:
+        Fn &mFn;
+    };
+
+    /* Collects the popped elements, and how many come from each shard. */
+    class PopCollector {
+    public:
+        PopCollector(KeyScoreVecType &result, std::vector<unsigned long> &counts)
+            : mResult(result), mCounts(counts) { mResult.clear(); }
+        template<typename Iterator>
+        void operator()(std::size_t shard, const Iterator &it) {
+            mResult.push_back(std::make_pair(*it, it.score()));
+            mCounts[shard]++;
+        }
+    private:
+        KeyScoreVecType &mResult;
+        std::vector<unsigned long> &mCounts;
+    };
+
+    class KeyCollector {
+    public:
+        KeyCollector(KeyVecType &result): mResult(result) { mResult.clear(); }
+        void operator()(const KeyType &key, ScoreType) { mResult.push_back(key); }
+    private:
+        KeyVecType &mResult;
+    };
+
+    class KeyScoreCollector {
+    public:
+        KeyScoreCollector(KeyScoreVecType &result): mResult(result) { mResult.clear(); }
+        void operator()(const KeyType &key, ScoreType score) { mResult.push_back(std::make_pair(key, score)); }
+    private:
+        KeyScoreVecType &mResult;
+    };
+
+private:
+    /* murmur3's finalizer: the shards must not pick the same hash bits as
+     * the Dict of each shard does. */
+    std::size_t shard_index(const KeyType &key) const {
+        unsigned long long h = mHash(key);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return (std::size_t)(h % mCount);
+    }
+
+    Shard& shard_of(const KeyType &key) const {
+        return mShards[shard_index(key)];
+    }
+
+    unsigned long length(const ShardSets &sets) const {
+        unsigned long llen = 0;
+        for (std::size_t i = 0; i < mCount; i++)
+            llen += sets[i].zcard();
+        return llen;
+    }
+
+    /* Same as SortedSet::sanitize_rank_range(). */
+    static bool sanitize_rank_range(long &start, long &end, long llen) {
+        if (start < 0) start = llen+start;
+        if (end < 0) end = llen+end;
+        if (start < 0) start = 0;
+        if (start > end || start >= llen) {
+            return false;
+        }
+        if (end >= llen) end = llen-1;
+        return true;
+    }
+
+    /* The ranks [first, first + len) of a forward 'view' of 'set'. */
+    static void view_ranks(const SetType &set, const typename SetType::RangeViewType &view,
+                           unsigned long &first, unsigned long &len) {
+        if (view.empty()) {
+            first = len = 0;
+            return;
+        }
+        typename SetType::const_iterator last = view.end();
+        --last;
+        first = set.count_before(view.begin().score(), *view.begin());
+        len = set.count_before(last.score(), *last) - first + 1;
+    }
+
+    /* Split the first 'rank' elements of the ranges of all the shards, shard
+     * i holding its ranks [first[i], first[i] + len[i]), into how many come
+     * from every shard. Like FrozenView::seek() this is a binary search on
+     * the ranks, run on all the shards at once: taken[i] is known to lie in
+     * [lo[i], hi[i]], the middle element of the widest interval is counted
+     * in every shard, which narrows all of them. O(K log(N)) elements are
+     * probed at most, each one costing K count_before(). */
+    void split(const ShardSets &sets, unsigned long rank, const std::vector<unsigned long> &first,
+               const std::vector<unsigned long> &len, std::vector<unsigned long> &taken) const {
+        std::vector<unsigned long> hi(mCount), before(mCount);
+        for (std::size_t i = 0; i < mCount; i++) {
+            taken[i] = 0;
+            hi[i] = std::min(len[i], rank);
+        }
+        for (;;) {
+            std::size_t widest = 0;
+            for (std::size_t i = 1; i < mCount; i++) {
+                if (hi[i] - taken[i] > hi[widest] - taken[widest])
+                    widest = i;
+            }
+            if (hi[widest] == taken[widest])
+                return;
+            unsigned long mid = taken[widest] + (hi[widest] - taken[widest]) / 2, merged = 0;
+            long r = first[widest] + mid;
+            typename SetType::const_iterator it = sets[widest].zrange_view(r, r).begin();
+            for (std::size_t i = 0; i < mCount; i++) {
+                unsigned long n = (i == widest) ? first[i] + mid : sets[i].count_before(it.score(), *it);
+                before[i] = (n > first[i]) ? std::min(n - first[i], len[i]) : 0;
+                merged += before[i];
+            }
+            /* The element is in the split when fewer than 'rank' come first,
+             * and so is everything before it; otherwise nothing past it is. */
+            for (std::size_t i = 0; i < mCount; i++) {
+                if (merged < rank)
+                    taken[i] = std::max(taken[i], before[i] + (i == widest));
+                else
+                    hi[i] = std::min(hi[i], before[i]);
+            }
+        }
+    }
+
+    /* Merge the ranges of all the shards in set order (reversed if reverse),
+     * calling fn(key, score) on 'count' elements past the first 'skip'. The
+     * offset is split among the shards first, so only the elements returned
+     * are merged. */
+    template<typename Fn>
+    void merge_ranks(const ShardSets &sets, const std::vector<unsigned long> &first, const std::vector<unsigned long> &len,
+                     bool reverse, unsigned long skip, unsigned long count, Fn &fn) const {
+        unsigned long total = 0;
+        for (std::size_t i = 0; i < mCount; i++)
+            total += len[i];
+        if (skip >= total || count == 0)
+            return;
+        std::vector<unsigned long> taken(mCount);
+        split(sets, reverse ? total - skip : skip, first, len, taken);
+        ElementVisitor<Fn> visit(fn);
+        if (reverse) {
+            std::vector< Cursor<typename SetType::const_reverse_iterator> > heap;
+            for (std::size_t i = 0; i < mCount; i++) {
+                if (taken[i] == 0)
+                    continue;
+                long last = sets[i].zcard() - first[i] - 1;
+                typename SetType::ReverseRangeViewType view =
+                    sets[i].zrevrange_view(last - (taken[i] - 1), last);
+                heap.push_back(Cursor<typename SetType::const_reverse_iterator>(view.begin(), view.end(), i));
+            }
+            merge(heap, true, 0, count, visit);
+        }
+        else {
+            std::vector< Cursor<typename SetType::const_iterator> > heap;
+            for (std::size_t i = 0; i < mCount; i++) {
+                if (taken[i] == len[i])
+                    continue;
+                typename SetType::RangeViewType view =
+                    sets[i].zrange_view(first[i] + taken[i], first[i] + len[i] - 1);
+                heap.push_back(Cursor<typename SetType::const_iterator>(view.begin(), view.end(), i));
+            }
+            merge(heap, false, 0, count, visit);
+        }
+    }
+
+    /* Offsets up to MERGE_SKIP are skipped by the merge itself, that is
+     * cheaper than splitting them. */
+    template<typename Fn>
+    void zrange_generic(long start, long end, bool reverse, Fn &fn) const {
+        ReadAllGuard sets(*this);
+        if (!sanitize_rank_range(start, end, length(sets))) {
+            return;
+        }
+        if ((unsigned long)start > MERGE_SKIP) {
+            std::vector<unsigned long> first(mCount), len(mCount);
+            for (std::size_t i = 0; i < mCount; i++)
+                len[i] = sets[i].zcard();
+            merge_ranks(sets, first, len, reverse, start, (end-start)+1, fn);
+            return;
+        }
+        ElementVisitor<Fn> visit(fn);
+        if (reverse) {
+            std::vector< Cursor<typename SetType::const_reverse_iterator> > heap;
+            for (std::size_t i = 0; i < mCount; i++) {
+                if (sets[i].zcard() > 0)
+                    heap.push_back(Cursor<typename SetType::const_reverse_iterator>(
+                        sets[i].rbegin(), sets[i].rend(), i));
+            }
+            merge(heap, true, start, (end-start)+1, visit);
+        }
+        else {
+            std::vector< Cursor<typename SetType::const_iterator> > heap;
+            for (std::size_t i = 0; i < mCount; i++) {
+                if (sets[i].zcard() > 0)
+                    heap.push_back(Cursor<typename SetType::const_iterator>(
+                        sets[i].begin(), sets[i].end(), i));
+            }
+            merge(heap, false, start, (end-start)+1, visit);
+        }
+    }
+
+    /* Reversed ranges take their bounds as (max, min), like SortedSet does.
+     * Each shard only knows the ranks of its own elements: long LIMIT
+     * offsets go through merge_ranks(), with the ranks of every shard's
+     * part of the range. */
+    template<typename Fn>
+    void zrangebyscore_generic(ScoreType min, ScoreType max, bool reverse, Fn &fn,
+                               bool minex, bool maxex, long offset = 0, long count = -1) const {
+        if (offset < 0) {
+            return;
+        }
+        unsigned long limit = (count < 0) ? ULONG_MAX : count;
+        ReadAllGuard sets(*this);
+        if ((unsigned long)offset > MERGE_SKIP) {
+            std::vector<unsigned long> first(mCount), len(mCount);
+            for (std::size_t i = 0; i < mCount; i++) {
+                const SetType &set = sets[i];
+                view_ranks(set, reverse ? set.zrangebyscore_view(max, min, maxex, minex)
+                                        : set.zrangebyscore_view(min, max, minex, maxex), first[i], len[i]);
+            }
+            merge_ranks(sets, first, len, reverse, offset, limit, fn);
+            return;
+        }
+        ElementVisitor<Fn> visit(fn);
+        if (reverse) {
+            std::vector< Cursor<typename SetType::const_reverse_iterator> > heap;
+            for (std::size_t i = 0; i < mCount; i++) {
+                typename SetType::ReverseRangeViewType view =
+                    sets[i].zrevrangebyscore_view(min, max, minex, maxex);
+                if (!view.empty())
+                    heap.push_back(Cursor<typename SetType::const_reverse_iterator>(view.begin(), view.end(), i));
+            }
+            merge(heap, true, offset, limit, visit);
+        }
+        else {
+            std::vector< Cursor<typename SetType::const_iterator> > heap;
+            for (std::size_t i = 0; i < mCount; i++) {
+                typename SetType::RangeViewType view =
+                    sets[i].zrangebyscore_view(min, max, minex, maxex);
+                if (!view.empty())
+                    heap.push_back(Cursor<typename SetType::const_iterator>(view.begin(), view.end(), i));
+            }
+            merge(heap, false, offset, limit, visit);
+        }
+    }
+
+    /* Same as zrangebyscore_generic(), min and max in skiplist order. */
+    template<typename Fn>
+    void zrangebylex_generic(const LexBound &min, const LexBound &max, bool reverse, Fn &fn,
+                             long offset = 0, long count = -1) const {
+        if (offset < 0) {
+            return;
+        }
+        unsigned long limit = (count < 0) ? ULONG_MAX : count;
+        ReadAllGuard sets(*this);
+        if ((unsigned long)offset > MERGE_SKIP) {
+            std::vector<unsigned long> first(mCount), len(mCount);
+            for (std::size_t i = 0; i < mCount; i++)
+                view_ranks(sets[i], sets[i].zrangebylex_view(min, max), first[i], len[i]);
+            merge_ranks(sets, first, len, reverse, offset, limit, fn);
+            return;
+        }
+        ElementVisitor<Fn> visit(fn);
+        if (reverse) {
+            std::vector< Cursor<typename SetType::const_reverse_iterator> > heap;
+            for (std::size_t i = 0; i < mCount; i++) {
+                typename SetType::ReverseRangeViewType view = sets[i].zrevrangebylex_view(max, min);
+                if (!view.empty())
+                    heap.push_back(Cursor<typename SetType::const_reverse_iterator>(view.begin(), view.end(), i));
+            }
+            merge(heap, true, offset, limit, visit);
+        }
+        else {
+            std::vector< Cursor<typename SetType::const_iterator> > heap;
+            for (std::size_t i = 0; i < mCount; i++) {
+                typename SetType::RangeViewType view = sets[i].zrangebylex_view(min, max);
+                if (!view.empty())
+                    heap.push_back(Cursor<typename SetType::const_iterator>(view.begin(), view.end(), i));
+            }
+            merge(heap, false, offset, limit, visit);
+        }
+    }
+
+    void zpop_generic(bool max, long count, KeyScoreVecType &result) {
+        WriteAllGuard sets(*this);
+        std::vector<unsigned long> popped(mCount);
+        PopCollector collect(result, popped);
+        if (count <= 0)
+            return;
+        if (max) {
+            std::vector< Cursor<typename SetType::const_reverse_iterator> > heap;
+            for (std::size_t i = 0; i < mCount; i++) {
+                if (sets[i].zcard() > 0)
+                    heap.push_back(Cursor<typename SetType::const_reverse_iterator>(
+                        sets[i].rbegin(), sets[i].rend(), i));
+            }
+            merge(heap, true, 0, count, collect);
+        }
+        else {
+            std::vector< Cursor<typename SetType::const_iterator> > heap;
+            for (std::size_t i = 0; i < mCount; i++) {
+                if (sets[i].zcard() > 0)
+                    heap.push_back(Cursor<typename SetType::const_iterator>(
+                        sets[i].begin(), sets[i].end(), i));
+            }
+            merge(heap, false, 0, count, collect);
+        }
+        KeyScoreVecType discard;
+        for (std::size_t i = 0; i < mCount; i++) {
+            if (popped[i] == 0)
+                continue;
+            long pops = popped[i];
+            mShards[i].mSets.write([&](SetType &set, bool) {
+                if (max) set.zpopmax(pops, discard); else set.zpopmin(pops, discard);
+            });
+        }
+    }
+
+    bool zrank_generic(const KeyType &key, bool reverse, unsigned long &rank) const {
+        ReadAllGuard sets(*this);
+        ScoreType score;
+        if (!sets[shard_index(key)].zscore(key, score)) {
+            return false;
+        }
+        rank = 0;
+        for (std::size_t i = 0; i < mCount; i++)
+            rank += sets[i].count_before(score, key);
+        if (reverse) {
+            rank = length(sets) - 1 - rank;
+        }
+        return true;
+    }
+
+public:
+    ShardedSortedSet(std::size_t shards = 16): mCount(shards ? shards : 1), mExpireNext(0)
+    {
+        mShards = new Shard[mCount];
+    }
+
+    ~ShardedSortedSet()
+    {
+        delete [] mShards;
+    }
+
+    std::size_t shard_count() const {
+        return mCount;
+    }
+
+    void zadd(const KeyType &key, ScoreType score) {
+        Shard &shard = shard_of(key);
+        WriteGuard guard(shard.mLock);
+        shard.mSets.write([&](SetType &set, bool) { set.zadd(key, score); }, true);
+    }
+
+    void zadd(KeyType &&key, ScoreType score) {
+        Shard &shard = shard_of(key);
+        WriteGuard guard(shard.mLock);
+        shard.mSets.write([&](SetType &set, bool last) { if (last) set.zadd(std::move(key), score); else set.zadd(key, score); }, true);
+    }
+
+    void zincrby(const KeyType &key, ScoreType score) {
+        Shard &shard = shard_of(key);
+        WriteGuard guard(shard.mLock);
+        shard.mSets.write([&](SetType &set, bool) { set.zincrby(key, score); }, true);
+    }
+
+    void zincrby(KeyType &&key, ScoreType score) {
+        Shard &shard = shard_of(key);
+        WriteGuard guard(shard.mLock);
+        shard.mSets.write([&](SetType &set, bool last) { if (last) set.zincrby(std::move(key), score); else set.zincrby(key, score); }, true);
+    }
+
+    void zrem(const KeyType &key) {
+        Shard &shard = shard_of(key);
+        WriteGuard guard(shard.mLock);
+        shard.mSets.write([&](SetType &set, bool) { set.zrem(key); }, true);
+    }
+
+    /* The batch is split per shard, every shard is then updated in one go
+     * under its own lock. */
+    void zadd_many(const KeyScoreVecType &items) {
+        std::vector<KeyScoreVecType> batches(mCount);
+        for (std::size_t i = 0; i < items.size(); i++)
+            batches[shard_index(items[i].first)].push_back(items[i]);
+        for (std::size_t i = 0; i < mCount; i++) {
+            if (batches[i].empty()) continue;
+            WriteGuard guard(mShards[i].mLock);
+            mShards[i].mSets.write([&](SetType &set, bool) { set.zadd_many(batches[i]); });
+        }
+    }
+
+    void zrem_many(const KeyVecType &keys) {
+        std::vector<KeyVecType> batches(mCount);
+        for (std::size_t i = 0; i < keys.size(); i++)
+            batches[shard_index(keys[i])].push_back(keys[i]);
+        for (std::size_t i = 0; i < mCount; i++) {
+            if (batches[i].empty()) continue;
+            WriteGuard guard(mShards[i].mLock);
+            mShards[i].mSets.write([&](SetType &set, bool) { set.zrem_many(batches[i]); });
+        }
+    }
+
+    void zremrangebyscore(ScoreType min, ScoreType max, bool minex = false, bool maxex = false) {
+        WriteAllGuard sets(*this);
+        for (std::size_t i = 0; i < mCount; i++)
+            mShards[i].mSets.write([&](SetType &set, bool) { set.zremrangebyscore(min, max, minex, maxex); });
+    }
+
+    /* split() finds how many elements of every shard come before 'start'
+     * and up to 'end', each shard then drops its own part of the range by
+     * rank, nothing is walked. */
+    void zremrangebyrank(long start, long end) {
+        WriteAllGuard sets(*this);
+        if (!sanitize_rank_range(start, end, length(sets))) {
+            return;
+        }
+        std::vector<unsigned long> first(mCount), len(mCount), before(mCount), upto(mCount);
+        for (std::size_t i = 0; i < mCount; i++)
+            len[i] = sets[i].zcard();
+        split(sets, start, first, len, before);
+        split(sets, end + 1, first, len, upto);
+        for (std::size_t i = 0; i < mCount; i++) {
+            if (upto[i] > before[i])
+                mShards[i].mSets.write([&](SetType &set, bool) { set.zremrangebyrank(before[i], upto[i] - 1); });
+        }
+    }
+
+    /* The popped elements are found by merging the shards, then every shard
+     * pops its own share. */
+    void zpopmin(long count, KeyScoreVecType &result) {
+        zpop_generic(false, count, result);
+    }
+
+    void zpopmax(long count, KeyScoreVecType &result) {
+        zpop_generic(true, count, result);
+    }
+
+    bool pexpireat(const KeyType &key, unsigned long long when) {
+        Shard &shard = shard_of(key);
+        WriteGuard guard(shard.mLock);
+        bool result;
+        shard.mSets.write([&](SetType &set, bool) { result = set.pexpireat(key, when); });
+        return result;
+    }
+
+    bool pexpire(const KeyType &key, unsigned long long ttl) {
+        return pexpireat(key, SetType::now_ms() + ttl);
+    }
+
+    bool persist(const KeyType &key) {
+        Shard &shard = shard_of(key);
+        WriteGuard guard(shard.mLock);
+        bool result;
+        shard.mSets.write([&](SetType &set, bool) { result = set.persist(key); });
+        return result;
+    }
+
+    /* Every shard gets its share of the budget, under its own lock only:
+     * budget / K entries, one more for the first budget % K shards counted
+     * from a shard moving on at every call, plus what the shards before it
+     * left unused. The whole call looks at no more than 'budget' entries. */
+    std::size_t expire_step(std::size_t budget, unsigned long long now) {
+        std::size_t removed = 0, removed_shard, unused = 0;
+        std::size_t start = mExpireNext.fetch_add(1, std::memory_order_relaxed) % mCount;
+        for (std::size_t j = 0; j < mCount; j++) {
+            std::size_t i = (start + j) % mCount;
+            std::size_t share = budget / mCount + (j < budget % mCount) + unused;
+            if (share == 0)
+                continue;
+            WriteGuard guard(mShards[i].mLock);
+            mShards[i].mSets.write([&](SetType &set, bool) { removed_shard = set.expire_step(share, now, &unused); });
+            removed += removed_shard;
+        }
+        return removed;
+    }
+
+    std::size_t expire_step(std::size_t budget) {
+        return expire_step(budget, SetType::now_ms());
+    }
+
+    void zremrangebylex(const LexBound &min, const LexBound &max) {
+        WriteAllGuard sets(*this);
+        for (std::size_t i = 0; i < mCount; i++)
+            mShards[i].mSets.write([&](SetType &set, bool) { set.zremrangebylex(min, max); });
+    }
+
+    void zrange(long start, long end, KeyVecType &result) const {
+        KeyCollector collect(result);
+        zrange_generic(start, end, false, collect);
+    }
+
+    void zrevrange(long start, long end, KeyVecType &result) const {
+        KeyCollector collect(result);
+        zrange_generic(start, end, true, collect);
+    }
+
+    void zrange_withscores(long start, long end, KeyScoreVecType &result) const {
+        KeyScoreCollector collect(result);
+        zrange_generic(start, end, false, collect);
+    }
+
+    void zrevrange_withscores(long start, long end, KeyScoreVecType &result) const {
+        KeyScoreCollector collect(result);
+        zrange_generic(start, end, true, collect);
+    }
+
+    void zrangebyscore(ScoreType min, ScoreType max, KeyVecType &result, bool minex = false, bool maxex = false) const {
+        KeyCollector collect(result);
+        zrangebyscore_generic(min, max, false, collect, minex, maxex);
+    }
+
+    void zrevrangebyscore(ScoreType min, ScoreType max, KeyVecType &result, bool minex = false, bool maxex = false) const {
+        KeyCollector collect(result);
+        zrangebyscore_generic(min, max, true, collect, minex, maxex);
+    }
+
+    void zrangebyscore_withscores(ScoreType min, ScoreType max, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+        KeyScoreCollector collect(result);
+        zrangebyscore_generic(min, max, false, collect, minex, maxex);
+    }
+
+    void zrevrangebyscore_withscores(ScoreType min, ScoreType max, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+        KeyScoreCollector collect(result);
+        zrangebyscore_generic(min, max, true, collect, minex, maxex);
+    }
+
+    /* Visitors run while every shard is being read, they must not write to
+     * the set: the write would wait for the read to end. */
+    template<typename Fn>
+    void zrange(long start, long end, Fn fn) const {
+        zrange_generic(start, end, false, fn);
+    }
+
+    template<typename Fn>
+    void zrevrange(long start, long end, Fn fn) const {
+        zrange_generic(start, end, true, fn);
+    }
+
+    template<typename Fn>
+    void zrangebyscore(ScoreType min, ScoreType max, Fn fn, bool minex = false, bool maxex = false) const {
+        zrangebyscore_generic(min, max, false, fn, minex, maxex);
+    }
+
+    template<typename Fn>
+    void zrevrangebyscore(ScoreType min, ScoreType max, Fn fn, bool minex = false, bool maxex = false) const {
+        zrangebyscore_generic(min, max, true, fn, minex, maxex);
+    }
+
+    void zrangebyscore_limit(ScoreType min, ScoreType max, long offset, long count, KeyVecType &result, bool minex = false, bool maxex = false) const {
+        KeyCollector collect(result);
+        zrangebyscore_generic(min, max, false, collect, minex, maxex, offset, count);
+    }
+
+    void zrevrangebyscore_limit(ScoreType min, ScoreType max, long offset, long count, KeyVecType &result, bool minex = false, bool maxex = false) const {
+        KeyCollector collect(result);
+        zrangebyscore_generic(min, max, true, collect, minex, maxex, offset, count);
+    }
+
+    void zrangebyscore_withscores_limit(ScoreType min, ScoreType max, long offset, long count, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+        KeyScoreCollector collect(result);
+        zrangebyscore_generic(min, max, false, collect, minex, maxex, offset, count);
+    }
+
+    void zrevrangebyscore_withscores_limit(ScoreType min, ScoreType max, long offset, long count, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+        KeyScoreCollector collect(result);
+        zrangebyscore_generic(min, max, true, collect, minex, maxex, offset, count);
+    }
+
+    template<typename Fn>
+    void zrangebyscore_limit(ScoreType min, ScoreType max, long offset, long count, Fn fn, bool minex = false, bool maxex = false) const {
+        zrangebyscore_generic(min, max, false, fn, minex, maxex, offset, count);
+    }
+
+    template<typename Fn>
+    void zrevrangebyscore_limit(ScoreType min, ScoreType max, long offset, long count, Fn fn, bool minex = false, bool maxex = false) const {
+        zrangebyscore_generic(min, max, true, fn, minex, maxex, offset, count);
+    }
+
+    void zrangebylex(const LexBound &min, const LexBound &max, KeyVecType &result) const {
+        KeyCollector collect(result);
+        zrangebylex_generic(min, max, false, collect);
+    }
+
+    void zrevrangebylex(const LexBound &max, const LexBound &min, KeyVecType &result) const {
+        KeyCollector collect(result);
+        zrangebylex_generic(min, max, true, collect);
+    }
+
+    void zrangebylex_limit(const LexBound &min, const LexBound &max, long offset, long count, KeyVecType &result) const {
+        KeyCollector collect(result);
+        zrangebylex_generic(min, max, false, collect, offset, count);
+    }
+
+    void zrevrangebylex_limit(const LexBound &max, const LexBound &min, long offset, long count, KeyVecType &result) const {
+        KeyCollector collect(result);
+        zrangebylex_generic(min, max, true, collect, offset, count);
+    }
+
+    template<typename Fn>
+    void zrangebylex(const LexBound &min, const LexBound &max, Fn fn) const {
+        zrangebylex_generic(min, max, false, fn);
+    }
+
+    template<typename Fn>
+    void zrevrangebylex(const LexBound &max, const LexBound &min, Fn fn) const {
+        zrangebylex_generic(min, max, true, fn);
+    }
+
+    template<typename Fn>
+    void zrangebylex_limit(const LexBound &min, const LexBound &max, long offset, long count, Fn fn) const {
+        zrangebylex_generic(min, max, false, fn, offset, count);
+    }
+
+    template<typename Fn>
+    void zrevrangebylex_limit(const LexBound &max, const LexBound &min, long offset, long count, Fn fn) const {
+        zrangebylex_generic(min, max, true, fn, offset, count);
+    }
+
+    unsigned long zlexcount(const LexBound &min, const LexBound &max) const {
+        ReadAllGuard sets(*this);
+        unsigned long count = 0;
+        for (std::size_t i = 0; i < mCount; i++)
+            count += sets[i].zlexcount(min, max);
+        return count;
+    }
+
+    unsigned long zcount(ScoreType min, ScoreType max, bool minex = false, bool maxex = false) const {
+        ReadAllGuard sets(*this);
+        unsigned long count = 0;
+        for (std::size_t i = 0; i < mCount; i++)
+            count += sets[i].zcount(min, max, minex, maxex);
+        return count;
+    }
+
+    unsigned long zcard() const {
+        ReadAllGuard sets(*this);
+        return length(sets);
+    }
+
+    bool zscore(const KeyType &key, ScoreType &score) const {
+        Shard &shard = shard_of(key);
+        ReadGuard guard(shard.mSets);
+        return guard.set().zscore(key, score);
+    }
+
+    bool pexpiretime(const KeyType &key, unsigned long long &when) const {
+        Shard &shard = shard_of(key);
+        ReadGuard guard(shard.mSets);
+        return guard.set().pexpiretime(key, when);
+    }
+
+    bool expire_pending(unsigned long long now) const {
+        for (std::size_t i = 0; i < mCount; i++) {
+            ReadGuard guard(mShards[i].mSets);
+            if (guard.set().expire_pending(now))
+                return true;
+        }
+        return false;
+    }
+
+    bool zrank(const KeyType &key, unsigned long &rank) const {
+        return zrank_generic(key, false, rank);
+    }
+
+    bool zrevrank(const KeyType &key, unsigned long &rank) const {
+        return zrank_generic(key, true, rank);
+    }
+
+private:
+    ShardedSortedSet(const ShardedSortedSet&);
+    ShardedSortedSet& operator=(const ShardedSortedSet&);
+
+    /* Offsets up to this many elements cost less to walk than to split. */
+    static const unsigned long MERGE_SKIP = 1024;
+
+    Shard *mShards;
+    std::size_t mCount;
+    HashFn mHash;
+    /* The shard expire_step() starts from. */
+    std::atomic<std::size_t> mExpireNext;
+};
+
+#endif
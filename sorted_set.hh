@@ -18,9 +18,26 @@
 #define SORTEDSET_hh_INCLUDED
 
 #include <cassert>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <new>
 #include <vector>
+#include <type_traits>
+#include <utility>
+#include <iterator>
+#include <algorithm>
 #include <iostream>
+#include <fstream>
+#include <string>
 #include <functional>
+#include <limits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <atomic>
 
 #if defined __GNUC__
 #   if  __GNUC__ >= 4 && __GNUC_MINOR__ >= 3
@@ -36,496 +53,2814 @@
 #   error not GNU C Compiler
 #endif
 
+/* Key codecs, used by SortedSet::save() and SortedSet::load().
+ * A codec turns a key into bytes and back:
+ *     template<typename Writer> static void encode(const KeyType &key, Writer &w);
+ *         (calls w.write(const void *p, std::size_t n) as many times as needed)
+ *     static bool decode(const char *&p, const char *end, KeyType &key);
+ *         (advances p past the key, false on truncated or corrupt data)
+ * Arithmetic keys are stored as they are in memory, std::string keys are
+ * stored as a 64 bits length followed by the bytes. Specialize it for other
+ * key types. */
+template<typename KeyType, typename Enable = void>
+class SortedSetKeyCodec;
+
+template<typename KeyType>
+class SortedSetKeyCodec<KeyType, typename std::enable_if<std::is_arithmetic<KeyType>::value>::type> {
+public:
+    template<typename Writer>
+    static void encode(const KeyType &key, Writer &w) {
+        w.write(&key, sizeof(key));
+    }
+
+    static bool decode(const char *&p, const char *end, KeyType &key) {
+        if ((std::size_t)(end - p) < sizeof(key)) return false;
+        std::memcpy(&key, p, sizeof(key));
+        p += sizeof(key);
+        return true;
+    }
+};
+
+template<>
+class SortedSetKeyCodec<std::string> {
+public:
+    template<typename Writer>
+    static void encode(const std::string &key, Writer &w) {
+        unsigned long long len = key.size();
+        w.write(&len, sizeof(len));
+        w.write(key.data(), key.size());
+    }
+
+    static bool decode(const char *&p, const char *end, std::string &key) {
+        unsigned long long len;
+        if ((std::size_t)(end - p) < sizeof(len)) return false;
+        std::memcpy(&len, p, sizeof(len));
+        p += sizeof(len);
+        if ((std::size_t)(end - p) < len) return false;
+        key.assign(p, len);
+        p += len;
+        return true;
+    }
+};
+
+/* The size of a key, as checked against the key size limit of the compact
+ * encoding (see SortedSet::set_compact_limits()): sizeof() by default, the
+ * length of std::string keys. Specialize it for other keys owning memory. */
+template<typename KeyType>
+class SortedSetKeySize {
+public:
+    static std::size_t size(const KeyType &) { return sizeof(KeyType); }
+};
+
+template<>
+class SortedSetKeySize<std::string> {
+public:
+    static std::size_t size(const std::string &key) { return key.size(); }
+};
+
+/* Scores may be of any type ordered by <, > and ==, with += for zincrby()
+ * (double by default, integers for exact scores past 2^53, or float and
+ * 32 bits integers for smaller nodes). lowest() and highest() are the score
+ * bounds of open ended ranges, like -inf and +inf in Redis: they are the
+ * infinities of floating point types and the limits of integer types.
+ * Specialize it for other score types. */
+template<typename ScoreType>
+class SortedSetScoreTraits {
+public:
+    static ScoreType lowest() {
+        return std::numeric_limits<ScoreType>::has_infinity ?
+            -std::numeric_limits<ScoreType>::infinity() : std::numeric_limits<ScoreType>::lowest();
+    }
+    static ScoreType highest() {
+        return std::numeric_limits<ScoreType>::has_infinity ?
+            std::numeric_limits<ScoreType>::infinity() : std::numeric_limits<ScoreType>::max();
+    }
+};
+
+/* Node allocators.
+ * SortedSet asks its allocator for raw blocks of 'size' bytes holding a node
+ * with 'level' levels, and gives them back with the same size and level:
+ *     void* allocate(std::size_t size, int level);
+ *     void deallocate(void *p, std::size_t size, int level);
+ *     void release();
+ *     void swap(Allocator &other);
+ * swap() exchanges the blocks of two allocators, for SortedSet::swap().
+ * If RELEASE_ALL is true, release() frees every block the allocator has ever
+ * handed out at once, so the SortedSet may drop all its nodes without
+ * deallocating them one by one. */
+class SortedSetHeapAllocator {
+public:
+    static const bool RELEASE_ALL = false;
+
+    void* allocate(std::size_t size, int /*level*/) {
+        return ::operator new(size);
+    }
+
+    void deallocate(void *p, std::size_t /*size*/, int /*level*/) {
+        ::operator delete(p);
+    }
+
+    void release() {}
+
+    void swap(SortedSetHeapAllocator&) {}
+};
+
+/* A size-class pool, one class per node level. Freed nodes are kept on the
+ * free list of their level and recycled by the next node of the same level,
+ * fresh nodes are carved out of slabs which are only returned to the system
+ * by release() (or the destructor), all at once. A pool belongs to one
+ * SortedSet, so it is neither copyable nor thread safe. */
+class SortedSetPoolAllocator {
+public:
+    static const bool RELEASE_ALL = true;
+
+    SortedSetPoolAllocator(): mSlabs(NULL) {}
+
+    ~SortedSetPoolAllocator() {
+        release();
+    }
+
+    void* allocate(std::size_t size, int level) {
+        if (level >= (int)mClasses.size())
+            mClasses.resize(level+1);
+        SizeClass &sc = mClasses[level];
+        if (sc.mFree) {
+            FreeBlock *b = sc.mFree;
+            sc.mFree = b->mNext;
+            return b;
+        }
+        size = block_size(size);
+        if (sc.mCursor == NULL || sc.mCursor + size > sc.mEnd) {
+            /* Current slab of this class is exhausted, carve a new one. */
+            std::size_t count = SLAB_BYTES / size;
+            if (count == 0) count = 1;
+            Slab *slab = static_cast<Slab*>(::operator new(sizeof(Slab) + count * size));
+            slab->mNext = mSlabs;
+            mSlabs = slab;
+            sc.mCursor = reinterpret_cast<char*>(slab + 1);
+            sc.mEnd = sc.mCursor + count * size;
+        }
+        void *p = sc.mCursor;
+        sc.mCursor += size;
+        return p;
+    }
+
+    void deallocate(void *p, std::size_t /*size*/, int level) {
+        SizeClass &sc = mClasses[level];
+        FreeBlock *b = static_cast<FreeBlock*>(p);
+        b->mNext = sc.mFree;
+        sc.mFree = b;
+    }
+
+    void release() {
+        while (mSlabs) {
+            Slab *next = mSlabs->mNext;
+            ::operator delete(mSlabs);
+            mSlabs = next;
+        }
+        mClasses.clear();
+    }
+
+    void swap(SortedSetPoolAllocator &other) {
+        mClasses.swap(other.mClasses);
+        std::swap(mSlabs, other.mSlabs);
+    }
+
+private:
+    SortedSetPoolAllocator(const SortedSetPoolAllocator&);
+    SortedSetPoolAllocator& operator=(const SortedSetPoolAllocator&);
+
+    static const std::size_t SLAB_BYTES = 16384;
+    static const std::size_t ALIGN = 16;
+
+    static std::size_t block_size(std::size_t size) {
+        return (size + ALIGN - 1) & ~(ALIGN - 1);
+    }
+
+    union Slab {
+        Slab *mNext;
+        /* Keep the blocks following the slab header aligned. */
+        char mPad[ALIGN];
+    };
+    struct FreeBlock {
+        FreeBlock *mNext;
+    };
+    struct SizeClass {
+        SizeClass(): mFree(NULL), mCursor(NULL), mEnd(NULL) {}
+        FreeBlock *mFree;
+        char *mCursor, *mEnd;
+    };
+
+    Slab *mSlabs;
+    std::vector<SizeClass> mClasses;
+};
+
+/* Instrumentation policies, the 9th template argument of SortedSet. A set
+ * calls these hooks of its policy:
+ *     static const bool ENABLED;
+ *     void on_insert();           a new member was added
+ *     void on_update();           zadd/zincrby of a member already there
+ *     void on_descent(unsigned long hops, unsigned long compares);
+ *                                 a skiplist search (to insert, delete or
+ *                                 rank a node) moved 'hops' nodes forward
+ *                                 and compared 'compares' nodes
+ *     void on_range(std::size_t count, unsigned long long nanoseconds);
+ *                                 a zrange/zrevrange of 'count' elements
+ * The default, SortedSetNoInstrument, does nothing: its hooks are empty
+ * inline functions, the counting that feeds them is dead code the compiler
+ * drops, and clocks are only read when ENABLED. */
+class SortedSetNoInstrument {
+public:
+    static const bool ENABLED = false;
+    void on_insert() {}
+    void on_update() {}
+    void on_descent(unsigned long /*hops*/, unsigned long /*compares*/) {}
+    void on_range(std::size_t /*count*/, unsigned long long /*nanoseconds*/) {}
+};
+
+/* Counts the events, and keeps the latency histogram of zrange calls per
+ * result size. Counters are relaxed atomics, so read commands of a
+ * ConcurrentSortedSet may update them in parallel. Histograms use power of
+ * 2 classes: class 0 holds 0, class c the values of [2^(c-1), 2^c). */
+class SortedSetCounters {
+public:
+    static const bool ENABLED = true;
+    static const int SIZE_CLASSES = 17;
+    static const int LATENCY_CLASSES = 40;
+
+    SortedSetCounters() {
+        reset();
+    }
+
+    void on_insert() { add(mInserts, 1); }
+    void on_update() { add(mUpdates, 1); }
+
+    void on_descent(unsigned long hops, unsigned long compares) {
+        add(mDescents, 1);
+        add(mHops, hops);
+        add(mCompares, compares);
+    }
+
+    void on_range(std::size_t count, unsigned long long nanoseconds) {
+        add(mRanges[size_class(count)][std::min(log_class(nanoseconds), LATENCY_CLASSES-1)], 1);
+    }
+
+    unsigned long inserts() const { return mInserts.load(std::memory_order_relaxed); }
+    unsigned long updates() const { return mUpdates.load(std::memory_order_relaxed); }
+    unsigned long descents() const { return mDescents.load(std::memory_order_relaxed); }
+    unsigned long hops() const { return mHops.load(std::memory_order_relaxed); }
+    unsigned long compares() const { return mCompares.load(std::memory_order_relaxed); }
+
+    /* How many zranges of the size class took a time of the latency class. */
+    unsigned long ranges(int sizeclass, int latencyclass) const {
+        return mRanges[sizeclass][latencyclass].load(std::memory_order_relaxed);
+    }
+
+    /* The 'quantile' (0.99 for the p99) of the latency of the zranges of the
+     * size class, rounded up to the end of its class, in nanoseconds. 0 when
+     * there were none. */
+    unsigned long long range_latency(int sizeclass, double quantile) const {
+        unsigned long total = 0, seen = 0;
+        int c;
+        for (c = 0; c < LATENCY_CLASSES; c++)
+            total += ranges(sizeclass, c);
+        if (total == 0)
+            return 0;
+        for (c = 0; c < LATENCY_CLASSES - 1; c++) {
+            seen += ranges(sizeclass, c);
+            if (seen >= quantile * total)
+                break;
+        }
+        return (1ULL << c) - 1;
+    }
+
+    /* The size class of a zrange returning 'count' elements. */
+    static int size_class(std::size_t count) {
+        return std::min(log_class(count), SIZE_CLASSES-1);
+    }
+
+    void reset() {
+        mInserts.store(0);
+        mUpdates.store(0);
+        mDescents.store(0);
+        mHops.store(0);
+        mCompares.store(0);
+        for (int i = 0; i < SIZE_CLASSES; i++)
+            for (int j = 0; j < LATENCY_CLASSES; j++)
+                mRanges[i][j].store(0);
+    }
+
+private:
+    SortedSetCounters(const SortedSetCounters&);
+    SortedSetCounters& operator=(const SortedSetCounters&);
+
+    static int log_class(unsigned long long v) {
+        return v ? 64 - __builtin_clzll(v) : 0;
+    }
+
+    static void add(std::atomic<unsigned long> &counter, unsigned long n) {
+        counter.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    std::atomic<unsigned long> mInserts, mUpdates, mDescents, mHops, mCompares;
+    std::atomic<unsigned long> mRanges[SIZE_CLASSES][LATENCY_CLASSES];
+};
+
+/* One level of a skiplist node: the next node on that level, and its span
+ * (how many elements it is ahead). Packed, aligned on the span only: 16
+ * bytes with 64 bits spans, 12 with 32 bits ones, 10 with 16 bits ones.
+ * With CacheScores the level also keeps a copy of the score of the next
+ * node, so that searches compare scores without loading the next node at
+ * all, but for score ties and for the nodes they actually move to. */
+template<typename NodeType, typename ScoreType, typename SpanType, bool CacheScores>
+class SortedSetLevel {
+public:
+    SortedSetLevel():mForward(NULL), mSpan(0) {}
+    ScoreType forward_score() const { return mForward->mScore; }
+    void set_forward(NodeType *x) { mForward = x; }
+    void copy_forward(const SortedSetLevel &other) { mForward = other.mForward; }
+    NodeType *mForward;
+    SpanType mSpan;
+} __attribute__((packed, aligned(sizeof(SpanType))));
+
+template<typename NodeType, typename ScoreType, typename SpanType>
+class SortedSetLevel<NodeType, ScoreType, SpanType, true> {
+public:
+    SortedSetLevel():mForward(NULL), mSpan(0), mForwardScore() {}
+    ScoreType forward_score() const { return mForwardScore; }
+    void set_forward(NodeType *x) { mForward = x; if (x) mForwardScore = x->mScore; }
+    void copy_forward(const SortedSetLevel &other) { mForward = other.mForward; mForwardScore = other.mForwardScore; }
+    NodeType *mForward;
+    SpanType mSpan;
+    ScoreType mForwardScore;
+} __attribute__((packed, aligned(sizeof(SpanType))));
+
 template< typename KeyType,
           typename HashFn = HASHSCOPE::hash<KeyType>,
-          typename EqualKey = std::equal_to<KeyType> >
+          typename EqualKey = std::equal_to<KeyType>,
+          typename Allocator = SortedSetHeapAllocator,
+          typename KeyCompare = std::less<KeyType>,
+          typename ScoreType = double,
+          typename SpanType = unsigned long,
+          bool CacheScores = false,
+          typename Instrument = SortedSetNoInstrument >
 class SortedSet {
-private:
-    typedef typename HASHSCOPE::unordered_map<KeyType, double, HashFn, EqualKey> DictType;
-    typedef typename DictType::iterator DictTypeIterator;
-    typedef typename DictType::const_iterator DictTypeConstIterator;
+public:
+    typedef KeyType key_type;
+    typedef ScoreType score_type;
+    typedef SpanType span_type;
+    typedef SortedSetScoreTraits<ScoreType> score_traits;
+    typedef HashFn hasher;
+    typedef KeyCompare key_compare;
     typedef typename std::vector<KeyType> KeyVecType;
     typedef typename KeyVecType::iterator KeyVecTypeIterator;
     typedef typename KeyVecType::const_iterator KeyVecTypeConstIterator;
-    typedef typename std::pair<KeyType, double> KeyScorePairType;
+    typedef typename std::pair<KeyType, ScoreType> KeyScorePairType;
     typedef typename std::vector<KeyScorePairType> KeyScoreVecType;
     typedef typename KeyScoreVecType::iterator KeyScoreVecTypeIterator;
     typedef typename KeyScoreVecType::const_iterator KeyScoreVecTypeConstIterator;
+
+    /* One end of a lex range, like the "[key", "(key", "-" and "+" bounds of
+     * Redis's ZRANGEBYLEX: inclusive(key), exclusive(key) and unbounded(). */
+    class LexBound {
+    public:
+        static LexBound inclusive(const KeyType &key) { return LexBound(key, false, false); }
+        static LexBound exclusive(const KeyType &key) { return LexBound(key, true, false); }
+        static LexBound unbounded() { return LexBound(KeyType(), false, true); }
+    private:
+        friend class SortedSet;
+        LexBound(const KeyType &key, bool exclusive, bool unbounded)
+            : mKey(key), mExclusive(exclusive), mUnbounded(unbounded) {}
+        KeyType mKey;
+        bool mExclusive, mUnbounded;
+    };
+
+    /* How zunionstore()/zinterstore() combine the scores of a member, like
+     * the AGGREGATE option of Redis's ZUNIONSTORE. */
+    enum Aggregate {
+        AGGREGATE_SUM,
+        AGGREGATE_MIN,
+        AGGREGATE_MAX
+    };
+    /* How many expired members a write reclaims at most by default, see
+     * set_expire_batch() */
+    static const std::size_t EXPIRE_BATCH = 16;
 private:
     static const int SKIPLIST_MAXLEVEL = 32;
+    /* Default limits of the compact encoding, just like Redis's
+     * zset-max-listpack-entries and zset-max-listpack-value. */
+    static const unsigned int COMPACT_MAX_ENTRIES = 128;
+    static const unsigned int COMPACT_MAX_KEY_SIZE = 64;
+    static const unsigned long long RANDOM_SEED = 88172645463325252ULL;
     // Fix for compile problems before C++11 compiler
     //static constexpr double SKIPLIST_P = 0.25;
     class SkipListNode;
-    class SkipListLevel;
+    typedef SortedSetLevel<SkipListNode, ScoreType, SpanType, CacheScores> SkipListLevel;
     class RangeSpec;
+    class Dict;
+    class Finger;
+    typedef HASHSCOPE::unordered_map<KeyType, unsigned long long, HashFn, EqualKey> ExpireDictType;
 private:
-    unsigned long length() {
-        return mLength;
+    unsigned long length() const {
+        return is_small() ? mSmall.size() : mLength;
+    }
+
+    /* Small sets use the compact encoding: no skiplist (not even mHeader) and
+     * no dict, just mSmall, the (key, score) pairs sorted by score then key. */
+    bool is_small() const {
+        return mHeader == NULL;
+    }
+
+    /* Index of the first entry not sorting before (score, key). */
+    std::size_t small_lower(ScoreType score, const KeyType &key) const
+    {
+        std::size_t lo = 0, hi = mSmall.size();
+        while (lo < hi) {
+            std::size_t mid = lo + (hi - lo) / 2;
+            const KeyScorePairType &e = mSmall[mid];
+            if (e.second < score || (e.second == score && mKeyCompare(e.first, key)))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    /* Same as small_score_bound(), for lex ranges. */
+    std::size_t small_lex_bound(const LexBound &min, const LexBound &max, bool past_max) const
+    {
+        std::size_t lo = 0, hi = mSmall.size();
+        while (lo < hi) {
+            std::size_t mid = lo + (hi - lo) / 2;
+            const KeyType &key = mSmall[mid].first;
+            if (past_max ? lex_lte_max(key, max) : !lex_gte_min(key, min))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    /* Index of the first entry with a score >= min (> min if exclusive), or
+     * past max if 'past_max', the entries in range are [begin, end). */
+    std::size_t small_score_bound(const RangeSpec &range, bool past_max) const
+    {
+        std::size_t lo = 0, hi = mSmall.size();
+        while (lo < hi) {
+            std::size_t mid = lo + (hi - lo) / 2;
+            ScoreType score = mSmall[mid].second;
+            if (past_max ? score_lte_max(score, range) : !score_gte_min(score, range))
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return lo;
+    }
+
+    /* Keys are looked up by a linear scan, like Redis does in its listpacks. */
+    long small_find(const KeyType &key) const
+    {
+        for (std::size_t i = 0; i < mSmall.size(); i++) {
+            if (mDict.equal(mSmall[i].first, key))
+                return i;
+        }
+        return -1;
+    }
+
+    bool small_key_fits(const KeyType &key) const
+    {
+        return SortedSetKeySize<KeyType>::size(key) <= mCompactKeySize;
+    }
+
+    /* Move entry i to the position of its new score. */
+    void small_update_score(std::size_t i, ScoreType newscore)
+    {
+        KeyScorePairType entry(std::move(mSmall[i]));
+        entry.second = newscore;
+        mSmall.erase(mSmall.begin() + i);
+        std::size_t pos = small_lower(newscore, entry.first);
+        mSmall.insert(mSmall.begin() + pos, std::move(entry));
+    }
+
+    /* Convert the compact encoding to the skiplist and the dict, in one
+     * linear pass since the entries are already sorted. */
+    void promote()
+    {
+        std::vector<KeyScorePairType> entries;
+        Finger finger;
+
+        entries.swap(mSmall);
+        mHeader = create_node(SKIPLIST_MAXLEVEL, ScoreType(), KeyType());
+        mDict.reserve(entries.size());
+        finger_reset(finger);
+        for (std::size_t i = 0; i < entries.size(); i++)
+            private_append(finger, entries[i].second, std::move(entries[i].first));
+        private_append_finish(finger);
+    }
+
+    /* Convert back to the compact encoding once a removal left few enough
+     * elements (half the limit, so a set does not flip back and forth), all
+     * with short enough keys. Never while frozen views rely on the skiplist. */
+    void maybe_demote()
+    {
+        maybe_demote(mCompactEntries / 2);
+    }
+
+    void maybe_demote(unsigned long limit)
+    {
+        if (is_small() || mFrozen != NULL || mLength > limit || mCompactEntries == 0)
+            return;
+        SkipListNode *x;
+        for (x = mHeader->mLevel[0].mForward; x; x = x->mLevel[0].mForward) {
+            if (!small_key_fits(x->mKey))
+                return;
+        }
+        std::vector<KeyScorePairType> entries;
+        entries.reserve(mLength);
+        for (x = mHeader->mLevel[0].mForward; x; x = x->mLevel[0].mForward)
+            entries.push_back(KeyScorePairType(std::move(x->mKey), x->mScore));
+        mDict.release();
+        free_all_nodes();
+        mLength = 0;
+        mLevel = 1;
+        mSmall.swap(entries);
+    }
+
+    /* xorshift64*, every set has its own generator: no lock shared by the
+     * sets of different threads (glibc's random() takes one), and the same
+     * inserts always build the same skiplist, see set_seed(). */
+    unsigned long long next_random()
+    {
+        mRandom ^= mRandom >> 12;
+        mRandom ^= mRandom << 25;
+        mRandom ^= mRandom >> 27;
+        return mRandom * 2685821657736338717ULL;
     }
 
+    /* A node goes one level up with probability 1/4 (SKIPLIST_P), that is
+     * for every two trailing zero bits of a random word. The top bit is set
+     * so the word is never 0, 63 bits give up to SKIPLIST_MAXLEVEL levels. */
     int randomlevel() 
     {
-        int level = 1;
-        while ((random()&0xFFFF) < (0.25/*SKIPLIST_P*/ * 0xFFFF))
-            level += 1;
+        int level = 1 + __builtin_ctzll(next_random() | (1ULL << 63)) / 2;
         return (level<SKIPLIST_MAXLEVEL) ? level : SKIPLIST_MAXLEVEL;
     }
 
-    SkipListNode* private_insert(double score, KeyType key) 
+    /* The skiplist is ordered by score, then by key (just like Redis orders
+     * its zset by score, then lexicographically), so every element has one
+     * exact position even when many of them share the same score. */
+    bool node_less(const SkipListNode *x, ScoreType score, const KeyType &key) const
     {
-        SkipListNode *update[SKIPLIST_MAXLEVEL], *x;
-        unsigned int rank[SKIPLIST_MAXLEVEL];
-        int i, level;
+        return x->mScore < score || (x->mScore == score && mKeyCompare(x->mKey, key));
+    }
 
-        x = mHeader;
-        for (i = mLevel-1; i >= 0; i--) {
-            /* store rank that is crossed to reach the insert position */
-            rank[i] = i == (mLevel-1) ? 0 : rank[i+1];
-            while (x->mLevel[i].mForward && x->mLevel[i].mForward->mScore < score) {
-                rank[i] += x->mLevel[i].mSpan;
-                x = x->mLevel[i].mForward;
+    bool node_greater(const SkipListNode *x, ScoreType score, const KeyType &key) const
+    {
+        return x->mScore > score || (x->mScore == score && mKeyCompare(key, x->mKey));
+    }
+
+    /* Same as node_less() and node_greater() on the next node of x on level
+     * i, which must be there, going through forward_score(): with
+     * CacheScores the next node is only loaded on a score tie. */
+    bool forward_less(const SkipListNode *x, int i, ScoreType score, const KeyType &key) const
+    {
+        ScoreType fscore = x->mLevel[i].forward_score();
+        return fscore < score || (fscore == score && mKeyCompare(x->mLevel[i].mForward->mKey, key));
+    }
+
+    bool forward_greater(const SkipListNode *x, int i, ScoreType score, const KeyType &key) const
+    {
+        ScoreType fscore = x->mLevel[i].forward_score();
+        return fscore > score || (fscore == score && mKeyCompare(key, x->mLevel[i].mForward->mKey));
+    }
+
+    /* Create a node with 'level' levels. The node and its level array live in
+     * one single allocation, the levels are stored inline right after the node
+     * (just like the flexible array member of Redis's zskiplistNode). */
+    static std::size_t node_size(int level)
+    {
+        return sizeof(SkipListNode) + (level-1) * sizeof(SkipListLevel);
+    }
+
+    template<typename K>
+    SkipListNode* create_node(int level, ScoreType score, K &&key)
+    {
+        void *mem = mAllocator.allocate(node_size(level), level);
+        mNodeBytes += node_size(level);
+        SkipListNode *x = new (mem) SkipListNode(level, score, std::forward<K>(key));
+        for (int i = 1; i < level; i++)
+            new (&x->mLevel[i]) SkipListLevel();
+        return x;
+    }
+
+    void free_node(SkipListNode *x)
+    {
+        int level = x->mLevelCount;
+        x->~SkipListNode();
+        mAllocator.deallocate(x, node_size(level), level);
+        mNodeBytes -= node_size(level);
+    }
+
+    /* Free the whole node chain, mHeader included. When the allocator can
+     * release all its memory at once there is no per-node deallocation, and
+     * no walk at all if the keys need no destructor. */
+    void free_all_nodes()
+    {
+        SkipListNode *node = mHeader, *next;
+        mFingerValid = false;
+        if (Allocator::RELEASE_ALL) {
+            if (!std::is_trivially_destructible<KeyType>::value) {
+                while (node) {
+                    next = node->mLevel[0].mForward;
+                    node->~SkipListNode();
+                    node = next;
+                }
             }
-            update[i] = x;
+            mAllocator.release();
         }
-        /* For skiplist self, 'key' stands
-         * we assume the key is not already inside, since we allow duplicated
-         * scores, and the re-insertion of score and redis object should never
-         * happen since the caller of zslInsert() should test in the hash table
-         * if the element is already inside or not. */
-        level = randomlevel();
-        if (level > mLevel) {
-            for (i = mLevel; i < level; i++) {
-                rank[i] = 0;
-                update[i] = mHeader;
-                update[i]->mLevel[i].mSpan = mLength;
+        else {
+            while (node) {
+                next = node->mLevel[0].mForward;
+                free_node(node);
+                node = next;
             }
-            mLevel = level;
         }
-        x = new SkipListNode(level, score, key);
-        for (i = 0; i < level; i++) {
-            x->mLevel[i].mForward = update[i]->mLevel[i].mForward;
-            update[i]->mLevel[i].mForward = x;
-    
-            /* update span covered by update[i] as x is
-             * inserted here */
-            x->mLevel[i].mSpan = update[i]->mLevel[i].mSpan - (rank[0] - rank[i]);
-            update[i]->mLevel[i].mSpan = (rank[0] - rank[i]) + 1;
+        mHeader = mTail = NULL;
+        mNodeBytes = 0;
+    }
+
+    /* Remove every element, from both the skiplist and the dict. */
+    void private_clear()
+    {
+        mExpires.clear();
+        mExpireHeap.clear();
+        if (is_small()) {
+            mSmall.clear();
+            return;
         }
-    
-        /* increment span for untouched levels */
-        for (i = level; i < mLevel; i++) {
-            update[i]->mLevel[i].mSpan++;
+        if (mFrozen != NULL) {
+            for (SkipListNode *x = mHeader->mLevel[0].mForward; x; x = x->mLevel[0].mForward)
+                frozen_remove(x);
         }
+        mDict.clear();
+        free_all_nodes();
+        mHeader = create_node(SKIPLIST_MAXLEVEL, ScoreType(), KeyType());
+        mLength = 0;
+        mLevel = 1;
+    }
 
-        x->mBackward = (update[0] == mHeader) ? NULL : update[0];
-        if (x->mLevel[0].mForward)
-            x->mLevel[0].mForward->mBackward = x;
+    /* Remove the first element, or the last one if 'max', moving it to *key
+     * and *score when they are not NULL. mHeader precedes the first node on
+     * all its levels, so popping it needs no search at all. */
+    void private_pop(bool max, KeyType *key, ScoreType *score)
+    {
+        if (is_small()) {
+            typename std::vector<KeyScorePairType>::iterator e = max ? mSmall.end() - 1 : mSmall.begin();
+            expire_forget(e->first);
+            if (key != NULL) *key = std::move(e->first);
+            if (score != NULL) *score = e->second;
+            mSmall.erase(e);
+            return;
+        }
+        SkipListNode *x = max ? mTail : mHeader->mLevel[0].mForward;
+        expire_forget(x->mKey);
+        frozen_remove(x);
+        mDict.erase(x);
+        if (max) {
+            private_delete(x);
+        }
+        else {
+            SkipListNode *update[SKIPLIST_MAXLEVEL];
+            for (int i = 0; i < mLevel; i++)
+                update[i] = mHeader;
+            private_delete_node(x, update);
+        }
+        if (key != NULL) *key = std::move(x->mKey);
+        if (score != NULL) *score = x->mScore;
+        free_node(x);
+    }
+
+    /* A full bounded set does not take a new member sorting past the element
+     * it would evict, see set_capacity(). */
+    bool capped_rejects(ScoreType score, const KeyType &key) const
+    {
+        if (mCapacity == 0 || length() < mCapacity)
+            return false;
+        if (is_small()) {
+            const KeyScorePairType &e = mKeepHighest ? mSmall.front() : mSmall.back();
+            return mKeepHighest ? (score < e.second || (score == e.second && mKeyCompare(key, e.first)))
+                                : (score > e.second || (score == e.second && mKeyCompare(e.first, key)));
+        }
+        return mKeepHighest ? node_greater(mHeader->mLevel[0].mForward, score, key)
+                            : node_less(mTail, score, key);
+    }
+
+    /* Evict the elements past the capacity of a bounded set. */
+    void capped_trim()
+    {
+        if (mCapacity == 0 || length() <= mCapacity)
+            return;
+        if (length() == mCapacity + 1) {
+            private_pop(!mKeepHighest, NULL, NULL);
+            return;
+        }
+        if (mKeepHighest)
+            zremrangebyrank(0, (long)(length() - mCapacity) - 1);
         else
-            mTail = x;
-        mLength++;
-        return x;
+            zremrangebyrank(mCapacity, -1);
     }
 
-    void private_delete_node(SkipListNode *x, SkipListNode **update) 
+    /* An expiry time, in the min-heap ordered by ExpireLater. */
+    class ExpireEntry {
+    public:
+        ExpireEntry(unsigned long long when, const KeyType &key): mWhen(when), mKey(key) {}
+        unsigned long long mWhen;
+        KeyType mKey;
+    };
+
+    class ExpireLater {
+    public:
+        bool operator()(const ExpireEntry &a, const ExpireEntry &b) const { return a.mWhen > b.mWhen; }
+    };
+
+    void private_zrem(const KeyType &key)
     {
-        int i;
-        for (i = 0; i < mLevel; i++) {
-            if (update[i]->mLevel[i].mForward == x) {
-                update[i]->mLevel[i].mSpan += x->mLevel[i].mSpan - 1;
-                update[i]->mLevel[i].mForward = x->mLevel[i].mForward;
-            } else {
-                update[i]->mLevel[i].mSpan -= 1;
+        if (is_small()) {
+            long i = small_find(key);
+            if (i >= 0) {
+                expire_forget(key);
+                mSmall.erase(mSmall.begin() + i);
             }
+            return;
         }
-        if (x->mLevel[0].mForward) {
-            x->mLevel[0].mForward->mBackward = x->mBackward;
-        } else {
-            mTail = x->mBackward;
+        SkipListNode *x = mDict.find(key);
+        if (x != NULL) {
+            expire_forget(key);
+            frozen_remove(x);
+            private_delete(x);
+            mDict.erase(x);
+            free_node(x);
         }
-        while(mLevel > 1 && mHeader->mLevel[mLevel-1].mForward == NULL)
-            mLevel--;
-        mLength--;
     }
 
-    /* Delete an element with matching score/key from the skiplist. */
-    bool private_delete(double score, KeyType key) 
+    bool private_exists(const KeyType &key) const
     {
-        SkipListNode *update[SKIPLIST_MAXLEVEL], *x;
-        int i;
-        x = mHeader;
-        for (i = mLevel-1; i >= 0; i--) {
-            while (x->mLevel[i].mForward && x->mLevel[i].mForward->mScore < score)
-                x = x->mLevel[i].mForward;
-            update[i] = x;
+        return is_small() ? small_find(key) >= 0 : mDict.find(key) != NULL;
+    }
+
+    /* Every removal forgets the expiry time of the member, so mExpires only
+     * holds members and a key added again starts without expiry. */
+    void expire_forget(const KeyType &key)
+    {
+        if (!mExpires.empty() && mExpires.erase(key) > 0)
+            expire_shrink();
+    }
+
+    /* Same for the compact entries [first, last) about to be erased. */
+    void expire_forget(std::size_t first, std::size_t last)
+    {
+        for (std::size_t i = first; i < last && !mExpires.empty(); i++)
+            expire_forget(mSmall[i].first);
+    }
+
+    /* The entries of forgotten or changed expiry times stay in the heap, and
+     * are skipped when they come out; past half stale entries the heap is
+     * rebuilt, and it goes away with the last expiry time. */
+    void expire_shrink()
+    {
+        if (mExpires.empty())
+            mExpireHeap.clear();
+        else if (mExpireHeap.size() >= 2 * mExpires.size() + 64)
+            expire_compact();
+    }
+
+    /* Writes reclaim a few expired members each, so sets with expiring
+     * members keep shrinking without expire_step() calls. The clock is only
+     * read when some member has an expiry time. */
+    void expire_tick()
+    {
+        if (mExpireBatch > 0 && !mExpireHeap.empty()) {
+            unsigned long long now = now_ms();
+            if (expire_pending(now))
+                expire_step(mExpireBatch, now);
+        }
+    }
+
+    /* One node and the next pointer per entry, plus the buckets. */
+    std::size_t expire_bytes() const
+    {
+        return mExpireHeap.capacity() * sizeof(ExpireEntry) + mExpires.bucket_count() * sizeof(void*)
+            + mExpires.size() * (sizeof(typename ExpireDictType::value_type) + sizeof(void*));
+    }
+
+    /* Rebuild the heap from mExpires, dropping the entries of changed or
+     * removed expiry times. */
+    void expire_compact()
+    {
+        mExpireHeap.clear();
+        for (typename ExpireDictType::const_iterator it = mExpires.begin(); it != mExpires.end(); ++it)
+            mExpireHeap.push_back(ExpireEntry(it->second, it->first));
+        std::make_heap(mExpireHeap.begin(), mExpireHeap.end(), ExpireLater());
+    }
+
+    template<typename K>
+    SkipListNode* private_insert(ScoreType score, K &&key) 
+    {
+        SkipListNode *x = create_node(randomlevel(), score, std::forward<K>(key));
+        private_insert_node(x);
+        return x;
+    }
+
+    /* Link a node which is not in the skiplist yet at the position of its
+     * score, keeping the level count it was created with. The search starts
+     * from the set's finger, see finger_seek(). */
+    void private_insert_node(SkipListNode *node) 
+    {
+        finger_seek(node->mScore, node->mKey);
+        private_link_node(node, mFinger);
+    }
+
+    /* Start a batch of searches from mHeader. */
+    void finger_reset(Finger &finger) const
+    {
+        for (int i = 0; i < mLevel; i++) {
+            finger.mUpdate[i] = mHeader;
+            finger.mRank[i] = 0;
+        }
+    }
+
+    /* Find the last node before (score, key) on every level, into finger.mUpdate,
+     * with their rank. On each level the search resumes from where the finger
+     * left it when that is further than the level above got, so a batch of
+     * searches in skiplist order walks the skiplist only once. */
+    void finger_search(Finger &finger, ScoreType score, const KeyType &key) const
+    {
+        SkipListNode *x = mHeader;
+        unsigned long traversed = 0, hops = 0, compares = 0;
+        int i;
+
+        for (i = mLevel-1; i >= 0; i--) {
+            if (finger.mRank[i] > traversed) {
+                x = finger.mUpdate[i];
+                traversed = finger.mRank[i];
+            }
+            while (x->mLevel[i].mForward && forward_less(x, i, score, key)) {
+                traversed += x->mLevel[i].mSpan;
+                x = x->mLevel[i].mForward;
+                hops++;
+            }
+            compares += (x->mLevel[i].mForward != NULL);
+            finger.mUpdate[i] = x;
+            finger.mRank[i] = traversed;
+        }
+        mInstrument.on_descent(hops, hops + compares);
+    }
+
+    /* Move the set's own finger, mFinger, to the search path of (score, key).
+     * It is left wherever the last single insertion or deletion took place
+     * (and stays valid until the skiplist is changed any other way), so the
+     * search climbs from there only as high as needed to get past the new
+     * position, then goes down: O(log(d)), d being the distance between
+     * the two positions, instead of O(log(N)) from mHeader. Appending in
+     * score order, or bumping scores by small steps, never climbs high. */
+    void finger_seek(ScoreType score, const KeyType &key)
+    {
+        SkipListNode *x;
+        unsigned long hops = 0, compares = 0;
+        int i = 0;
+
+        if (mFingerValid) {
+            /* The lowest level whose finger node is before the position and
+             * its next node is not: every level above is right as it is. */
+            for (; i < mLevel; i++) {
+                x = mFinger.mUpdate[i];
+                compares += 2;
+                if ((x == mHeader || node_less(x, score, key)) &&
+                    (x->mLevel[i].mForward == NULL || !forward_less(x, i, score, key)))
+                    break;
+            }
+        }
+        if (!mFingerValid || i == mLevel) {
+            i = mLevel-1;
+            x = mFinger.mUpdate[i];
+            if (!mFingerValid || (x != mHeader && !node_less(x, score, key)))
+                finger_reset(mFinger);
+        }
+        x = mFinger.mUpdate[i];
+        unsigned long traversed = mFinger.mRank[i];
+        for (; i >= 0; i--) {
+            while (x->mLevel[i].mForward && forward_less(x, i, score, key)) {
+                traversed += x->mLevel[i].mSpan;
+                x = x->mLevel[i].mForward;
+                hops++;
+            }
+            compares += (x->mLevel[i].mForward != NULL);
+            mFinger.mUpdate[i] = x;
+            mFinger.mRank[i] = traversed;
+        }
+        mFingerValid = true;
+        mInstrument.on_descent(hops, hops + compares);
+    }
+
+    /* Link a node after the position of the finger, which then moves past it.
+     * The node must sort after every node searched with the finger before. */
+    void private_insert_node(SkipListNode *node, Finger &finger) 
+    {
+        finger_search(finger, node->mScore, node->mKey);
+        private_link_node(node, finger);
+    }
+
+    /* Link a node right after the search path held by the finger. */
+    void private_link_node(SkipListNode *node, Finger &finger) 
+    {
+        SkipListNode **update = finger.mUpdate, *x;
+        unsigned long *rank = finger.mRank;
+        int i, level;
+
+        /* Any other finger moves nodes under the set's own one. */
+        if (&finger != &mFinger)
+            mFingerValid = false;
+        /* For skiplist self, 'key' stands
+         * we assume the key is not already inside, since we allow duplicated
+         * scores, and the re-insertion of score and redis object should never
+         * happen since the caller of zslInsert() should test in the hash table
+         * if the element is already inside or not. */
+        /* Every span must fit in a SpanType, the span of mHeader to NULL included. */
+        assert(mLength < (unsigned long)std::numeric_limits<SpanType>::max());
+        level = node->mLevelCount;
+        if (level > mLevel) {
+            for (i = mLevel; i < level; i++) {
+                rank[i] = 0;
+                update[i] = mHeader;
+                update[i]->mLevel[i].mSpan = mLength;
+            }
+            mLevel = level;
+        }
+        x = node;
+        for (i = 0; i < level; i++) {
+            x->mLevel[i].copy_forward(update[i]->mLevel[i]);
+            update[i]->mLevel[i].set_forward(x);
+    
+            /* update span covered by update[i] as x is
+             * inserted here */
+            x->mLevel[i].mSpan = update[i]->mLevel[i].mSpan - (rank[0] - rank[i]);
+            update[i]->mLevel[i].mSpan = (rank[0] - rank[i]) + 1;
+        }
+    
+        /* increment span for untouched levels */
+        for (i = level; i < mLevel; i++) {
+            update[i]->mLevel[i].mSpan++;
+        }
+
+        x->mBackward = (update[0] == mHeader) ? NULL : update[0];
+        if (x->mLevel[0].mForward)
+            x->mLevel[0].mForward->mBackward = x;
+        else
+            mTail = x;
+        mLength++;
+
+        /* The new node is the last one before the next insertion point. */
+        unsigned long xrank = rank[0] + 1;
+        for (i = 0; i < level; i++) {
+            update[i] = x;
+            rank[i] = xrank;
+        }
+    }
+
+    void private_delete_node(SkipListNode *x, SkipListNode **update) 
+    {
+        int i;
+        if (update != mFinger.mUpdate)
+            mFingerValid = false;
+        for (i = 0; i < mLevel; i++) {
+            if (update[i]->mLevel[i].mForward == x) {
+                update[i]->mLevel[i].mSpan += x->mLevel[i].mSpan - 1;
+                update[i]->mLevel[i].copy_forward(x->mLevel[i]);
+            } else {
+                update[i]->mLevel[i].mSpan -= 1;
+            }
+        }
+        if (x->mLevel[0].mForward) {
+            x->mLevel[0].mForward->mBackward = x->mBackward;
+        } else {
+            mTail = x->mBackward;
+        }
+        while(mLevel > 1 && mHeader->mLevel[mLevel-1].mForward == NULL)
+            mLevel--;
+        mLength--;
+    }
+
+    /* Unlink 'node' from the skiplist, the caller owns (and frees) it afterwards.
+     * The nodes before it do not move, so the set's finger stays valid. */
+    void private_delete(SkipListNode *node) 
+    {
+        finger_seek(node->mScore, node->mKey);
+        assert(mFinger.mUpdate[0]->mLevel[0].mForward == node);
+        private_delete_node(node, mFinger.mUpdate);
+    }
+
+    /* Unlink 'node' searching from the finger, the node must sort after every
+     * node searched with the finger before. */
+    void private_delete(SkipListNode *node, Finger &finger) 
+    {
+        finger_search(finger, node->mScore, node->mKey);
+        /* Elements are unique by (score, key), so the next one is 'node'. */
+        assert(finger.mUpdate[0]->mLevel[0].mForward == node);
+        private_delete_node(node, finger.mUpdate);
+    }
+
+    /* Bulk building: link a node after mTail, the finger holds the last node
+     * of every level. Spans running to the end of the skiplist are only
+     * fixed by private_append_finish(), so the skiplist is built bottom-up in
+     * a single pass, touching only the levels of each new node. */
+    template<typename K>
+    bool private_append(Finger &finger, ScoreType score, K &&key) 
+    {
+        std::size_t hash = mDict.hash(key);
+
+        /* Only elements sorting after the tail, and new keys, can be appended. */
+        if ((mTail != NULL && !node_less(mTail, score, key)) || mDict.find(key, hash) != NULL)
+            return false;
+
+        frozen_insert(key, score);
+        SkipListNode *x = create_node(randomlevel(), score, std::forward<K>(key));
+        private_append_node(x, finger);
+        mDict.insert(x, hash);
+        return true;
+    }
+
+    /* Link 'x', which is in the dict already (or will be), after mTail. */
+    void private_append_node(SkipListNode *x, Finger &finger) 
+    {
+        int i, level;
+
+        mFingerValid = false;
+        assert(mLength < (unsigned long)std::numeric_limits<SpanType>::max());
+        unsigned long xrank = mLength + 1;
+        level = x->mLevelCount;
+        if (level > mLevel) {
+            for (i = mLevel; i < level; i++) {
+                finger.mUpdate[i] = mHeader;
+                finger.mRank[i] = 0;
+            }
+            mLevel = level;
+        }
+        for (i = 0; i < level; i++) {
+            finger.mUpdate[i]->mLevel[i].set_forward(x);
+            finger.mUpdate[i]->mLevel[i].mSpan = xrank - finger.mRank[i];
+            finger.mUpdate[i] = x;
+            finger.mRank[i] = xrank;
+        }
+        x->mBackward = mTail;
+        mTail = x;
+        mLength++;
+    }
+
+    void private_append_finish(Finger &finger) 
+    {
+        for (int i = 0; i < mLevel; i++)
+            finger.mUpdate[i]->mLevel[i].mSpan = mLength - finger.mRank[i];
+    }
+
+    /* Deep copy of 'other' into this empty set: its nodes are cloned in
+     * order along level 0 and appended with fresh levels, so copying costs
+     * one linear pass, without a single search. */
+    void private_copy(const SortedSet &other)
+    {
+        Finger finger;
+
+        if (other.is_small()) {
+            mSmall = other.mSmall;
+            return;
+        }
+        mHeader = create_node(SKIPLIST_MAXLEVEL, ScoreType(), KeyType());
+        mDict.reserve(other.mLength);
+        finger_reset(finger);
+        for (SkipListNode *x = other.mHeader->mLevel[0].mForward; x; x = x->mLevel[0].mForward) {
+            SkipListNode *y = create_node(randomlevel(), x->mScore, x->mKey);
+            private_append_node(y, finger);
+            mDict.insert(y);
+        }
+        private_append_finish(finger);
+    }
+
+    /* Load elements into an empty set, in one linear pass as long as they
+     * come in (score, key) order with unique keys. Whatever follows the first
+     * element breaking that order is added the general way. */
+    void private_load(const KeyScorePairType *items, std::size_t count) 
+    {
+        Finger finger;
+        std::size_t i;
+
+        assert(length() == 0);
+        if (count <= mCompactEntries) {
+            zadd_many(items, count);
+            return;
+        }
+        if (is_small())
+            promote();
+        mDict.reserve(count);
+        finger_reset(finger);
+        for (i = 0; i < count && private_append(finger, items[i].second, items[i].first); i++)
+            ;
+        private_append_finish(finger);
+        if (i < count)
+            zadd_many(items + i, count - i);
+        capped_trim();
+    }
+
+    static ScoreType weighted_score(ScoreType score, const ScoreType *weights, std::size_t i)
+    {
+        if (weights != NULL)
+            score = ScoreType(weights[i] * score);
+        /* Like Redis, 0 * inf and inf + -inf give 0, never a NaN. */
+        return (score != score) ? ScoreType() : score;
+    }
+
+    static ScoreType aggregate_scores(ScoreType a, ScoreType b, Aggregate aggregate)
+    {
+        switch (aggregate) {
+        case AGGREGATE_MIN:
+            return (b < a) ? b : a;
+        case AGGREGATE_MAX:
+            return (b > a) ? b : a;
+        default:
+            a += b;
+            return (a != a) ? ScoreType() : a;
+        }
+    }
+
+    /* ZUNIONSTORE/ZINTERSTORE into this set, which must not be one of the
+     * inputs. The result members are created as nodes in the dict only, and
+     * their scores aggregated there: no skiplist search per input element.
+     * Then the nodes are sorted and appended in a single pass, just like
+     * private_load() does. Intersections walk the smallest input and look
+     * the others up. */
+    unsigned long private_store(const SortedSet *const *sets, std::size_t count,
+                                const ScoreType *weights, Aggregate aggregate, bool inter)
+    {
+        std::vector<SkipListNode*> fresh;
+        std::size_t i, j;
+
+        private_clear();
+        if (count == 0)
+            return 0;
+        if (is_small())
+            promote();
+        if (inter) {
+            std::size_t smallest = 0;
+            for (i = 1; i < count; i++) {
+                if (sets[i]->length() < sets[smallest]->length())
+                    smallest = i;
+            }
+            const SortedSet *set = sets[smallest];
+            mDict.reserve(set->length());
+            fresh.reserve(set->length());
+            for (const_iterator it = set->begin(); it != set->end(); ++it) {
+                ScoreType score = ScoreType(), other = ScoreType();
+                for (j = 0; j < count; j++) {
+                    if (j == smallest)
+                        other = it.score();
+                    else if (!sets[j]->zscore(it.key(), other))
+                        break;
+                    other = weighted_score(other, weights, j);
+                    score = (j == 0) ? other : aggregate_scores(score, other, aggregate);
+                }
+                if (j == count) {
+                    SkipListNode *x = create_node(randomlevel(), score, it.key());
+                    mDict.insert(x);
+                    fresh.push_back(x);
+                }
+            }
+        }
+        else {
+            std::size_t largest = 0;
+            for (i = 0; i < count; i++)
+                largest = std::max(largest, (std::size_t)sets[i]->length());
+            mDict.reserve(largest);
+            for (i = 0; i < count; i++) {
+                for (const_iterator it = sets[i]->begin(); it != sets[i]->end(); ++it) {
+                    ScoreType score = weighted_score(it.score(), weights, i);
+                    std::size_t hash = mDict.hash(it.key());
+                    SkipListNode *x = mDict.find(it.key(), hash);
+                    if (x == NULL) {
+                        x = create_node(randomlevel(), score, it.key());
+                        mDict.insert(x, hash);
+                        fresh.push_back(x);
+                    }
+                    else {
+                        x->mScore = aggregate_scores(x->mScore, score, aggregate);
+                    }
+                }
+            }
+        }
+
+        std::sort(fresh.begin(), fresh.end(), NodeLess(this));
+        Finger finger;
+        finger_reset(finger);
+        for (i = 0; i < fresh.size(); i++) {
+            frozen_insert(fresh[i]->mKey, fresh[i]->mScore);
+            private_append_node(fresh[i], finger);
+        }
+        private_append_finish(finger);
+        capped_trim();
+        maybe_demote(mCompactEntries);
+        return length();
+    }
+
+    unsigned long zstore_generic(const SortedSet *const *sets, std::size_t count,
+                                 const ScoreType *weights, Aggregate aggregate, bool inter)
+    {
+        if (std::find(sets, sets + count, this) == sets + count)
+            return private_store(sets, count, weights, aggregate, inter);
+        /* This set is one of the inputs: build the result aside first. */
+        SortedSet result;
+        KeyScoreVecType items;
+        result.set_compact_limits(mCompactEntries, mCompactKeySize);
+        result.private_store(sets, count, weights, aggregate, inter);
+        result.zrange_withscores(0, -1, items);
+        private_clear();
+        if (!items.empty())
+            private_load(&items[0], items.size());
+        maybe_demote(mCompactEntries);
+        return length();
+    }
+
+    /* Orders nodes the same way as the skiplist does. */
+    class NodeLess {
+    public:
+        NodeLess(const SortedSet *set): mSet(set) {}
+        bool operator()(const SkipListNode *a, const SkipListNode *b) const {
+            return mSet->node_less(a, b->mScore, b->mKey);
+        }
+    private:
+        const SortedSet *mSet;
+    };
+
+    /* Change the score of a node of the skiplist. When the node stays between
+     * its neighbours the score is just overwritten in place (unless the nodes
+     * before it cache it, see SortedSetLevel), otherwise the node is unlinked
+     * and linked back at its new position, it is never reallocated and stays
+     * in the dict as is. */
+    void private_update_score(SkipListNode *x, ScoreType newscore)
+    {
+        if (!CacheScores && (x->mBackward == NULL || node_less(x->mBackward, newscore, x->mKey)) &&
+            (x->mLevel[0].mForward == NULL || node_greater(x->mLevel[0].mForward, newscore, x->mKey))) {
+            x->mScore = newscore;
+            return;
+        }
+        private_delete(x);
+        x->mScore = newscore;
+        private_insert_node(x);
+    }
+
+    /* Keep the frozen views up to date, see FrozenView: called before a
+     * member gets a new score, before it is removed, and when a new one is
+     * added. Without views these are just a NULL test. */
+    void frozen_update(const SkipListNode *x, ScoreType newscore)
+    {
+        for (FrozenView *v = mFrozen; v != NULL; v = v->mNext) {
+            if (v->mNew->mDict.find(x->mKey) == NULL)
+                v->mOld->zadd(x->mKey, x->mScore);
+            v->mNew->zadd(x->mKey, newscore);
+        }
+    }
+
+    void frozen_remove(const SkipListNode *x)
+    {
+        for (FrozenView *v = mFrozen; v != NULL; v = v->mNext) {
+            if (v->mNew->mDict.find(x->mKey) != NULL)
+                v->mNew->zrem(x->mKey);
+            else
+                v->mOld->zadd(x->mKey, x->mScore);
+        }
+    }
+
+    void frozen_insert(const KeyType &key, ScoreType score)
+    {
+        for (FrozenView *v = mFrozen; v != NULL; v = v->mNext)
+            v->mNew->zadd(key, score);
+    }
+
+    static bool score_gte_min(ScoreType score, const RangeSpec &spec) {
+        return spec.mMinex ? (score > spec.mMin) : (score >= spec.mMin);
+    }
+
+    static bool score_lte_max(ScoreType score, const RangeSpec &spec) {
+        return spec.mMaxex ? (score < spec.mMax) : (score <= spec.mMax);
+    }
+
+    /* Returns if there is a part of the skiplist is in range. */
+    bool is_in_range(const RangeSpec &range) const {
+        SkipListNode *x;
+        /* Test for ranges that will always be empty. */
+        if (range.mMin > range.mMax || (range.mMin == range.mMax && (range.mMinex || range.mMaxex)))
+            return false;
+        x = mTail;
+        if (x == NULL || !score_gte_min(x->mScore, range))
+            return false;
+        x = mHeader->mLevel[0].mForward;
+        if (x == NULL || !score_lte_max(x->mScore, range))
+            return false;
+        return true;
+    }
+
+    /* Find the first node that is contained in the specified range.
+     * Returns NULL when no element is contained in the range. The 1-based
+     * rank of the node is counted along the way into *rank, if not NULL,
+     * so callers need no get_rank() descent. */
+    SkipListNode* first_in_range(const RangeSpec &range, unsigned long *rank = NULL) const {
+        SkipListNode *x;
+        unsigned long traversed = 0;
+        int i;
+    
+        /* If everything is out of range, return early. */
+        if (!is_in_range(range)) return NULL;
+    
+        x = mHeader;
+        for (i = mLevel-1; i >= 0; i--) {
+            /* Go forward while *OUT* of range. */
+            while (x->mLevel[i].mForward && !score_gte_min(x->mLevel[i].forward_score(), range)) {
+                traversed += x->mLevel[i].mSpan;
+                x = x->mLevel[i].mForward;
+            }
+        }
+    
+        /* This is an inner range, so the next node cannot be NULL. */
+        x = x->mLevel[0].mForward;
+        assert(x != NULL);
+
+        /* Check if score <= max. */
+        if (!score_lte_max(x->mScore, range)) return NULL;
+        if (rank != NULL) *rank = traversed + 1;
+        return x;
+    }
+
+    /* Find the last node that is contained in the specified range.
+     * Returns NULL when no element is contained in the range. Its 1-based
+     * rank goes into *rank, if not NULL. */
+    SkipListNode* last_in_range(const RangeSpec &range, unsigned long *rank = NULL) const {
+        SkipListNode *x;
+        unsigned long traversed = 0;
+        int i;
+    
+        /* If everything is out of range, return early. */
+        if (!is_in_range(range)) return NULL;
+    
+        x = mHeader;
+        for (i = mLevel-1; i >= 0; i--) {
+            /* Go forward while *IN* range. */
+            while (x->mLevel[i].mForward && score_lte_max(x->mLevel[i].forward_score(), range)) {
+                traversed += x->mLevel[i].mSpan;
+                x = x->mLevel[i].mForward;
+            }
+        }
+    
+        /* This is an inner range, so this node cannot be NULL. */
+        assert(x != NULL);
+    
+        /* Check if score >= min. */
+        if (!score_gte_min(x->mScore, range)) return NULL;
+        if (rank != NULL) *rank = traversed;
+        return x;
+    }
+
+    /* Lex ranges, for the ZRANGEBYLEX family. Just like in Redis they only
+     * compare keys, so they are meant for sets whose elements all have the
+     * same score: the skiplist is then ordered by key alone. */
+    bool lex_gte_min(const KeyType &key, const LexBound &min) const {
+        if (min.mUnbounded) return true;
+        return min.mExclusive ? mKeyCompare(min.mKey, key) : !mKeyCompare(key, min.mKey);
+    }
+
+    bool lex_lte_max(const KeyType &key, const LexBound &max) const {
+        if (max.mUnbounded) return true;
+        return max.mExclusive ? mKeyCompare(key, max.mKey) : !mKeyCompare(max.mKey, key);
+    }
+
+    /* Returns if there is a part of the skiplist in the lex range. */
+    bool is_in_lex_range(const LexBound &min, const LexBound &max) const {
+        SkipListNode *x;
+        /* Test for ranges that will always be empty. */
+        if (!min.mUnbounded && !max.mUnbounded &&
+            (mKeyCompare(max.mKey, min.mKey) ||
+             (!mKeyCompare(min.mKey, max.mKey) && (min.mExclusive || max.mExclusive))))
+            return false;
+        x = mTail;
+        if (x == NULL || !lex_gte_min(x->mKey, min))
+            return false;
+        x = mHeader->mLevel[0].mForward;
+        if (x == NULL || !lex_lte_max(x->mKey, max))
+            return false;
+        return true;
+    }
+
+    /* Same as first_in_range(), for lex ranges. */
+    SkipListNode* first_in_lex_range(const LexBound &min, const LexBound &max, unsigned long *rank = NULL) const {
+        SkipListNode *x;
+        unsigned long traversed = 0;
+        int i;
+
+        if (!is_in_lex_range(min, max)) return NULL;
+
+        x = mHeader;
+        for (i = mLevel-1; i >= 0; i--) {
+            /* Go forward while *OUT* of range. */
+            while (x->mLevel[i].mForward && !lex_gte_min(x->mLevel[i].mForward->mKey, min)) {
+                traversed += x->mLevel[i].mSpan;
+                x = x->mLevel[i].mForward;
+            }
+        }
+
+        /* This is an inner range, so the next node cannot be NULL. */
+        x = x->mLevel[0].mForward;
+        assert(x != NULL);
+
+        if (!lex_lte_max(x->mKey, max)) return NULL;
+        if (rank != NULL) *rank = traversed + 1;
+        return x;
+    }
+
+    /* Same as last_in_range(), for lex ranges. */
+    SkipListNode* last_in_lex_range(const LexBound &min, const LexBound &max, unsigned long *rank = NULL) const {
+        SkipListNode *x;
+        unsigned long traversed = 0;
+        int i;
+
+        if (!is_in_lex_range(min, max)) return NULL;
+
+        x = mHeader;
+        for (i = mLevel-1; i >= 0; i--) {
+            /* Go forward while *IN* range. */
+            while (x->mLevel[i].mForward && lex_lte_max(x->mLevel[i].mForward->mKey, max)) {
+                traversed += x->mLevel[i].mSpan;
+                x = x->mLevel[i].mForward;
+            }
+        }
+
+        /* This is an inner range, so this node cannot be NULL. */
+        assert(x != NULL);
+
+        if (!lex_gte_min(x->mKey, min)) return NULL;
+        if (rank != NULL) *rank = traversed;
+        return x;
+    }
+
+    /* Delete all the elements in the lex range, from the dict too. */
+    unsigned long private_delete_range_by_lex(const LexBound &min, const LexBound &max) {
+        SkipListNode *update[SKIPLIST_MAXLEVEL], *x;
+        unsigned long removed = 0;
+        int i;
+
+        if (!is_in_lex_range(min, max)) return 0;
+
+        /* Every element is in range: drop them all at once. */
+        if (lex_gte_min(mHeader->mLevel[0].mForward->mKey, min) && lex_lte_max(mTail->mKey, max)) {
+            removed = mLength;
+            private_clear();
+            return removed;
+        }
+
+        x = mHeader;
+        for (i = mLevel-1; i >= 0; i--) {
+            while (x->mLevel[i].mForward && !lex_gte_min(x->mLevel[i].mForward->mKey, min))
+                x = x->mLevel[i].mForward;
+            update[i] = x;
+        }
+
+        /* Current node is the last one before the range. */
+        x = x->mLevel[0].mForward;
+
+        /* Delete nodes while in range. */
+        while (x && lex_lte_max(x->mKey, max)) {
+            SkipListNode *next = x->mLevel[0].mForward;
+            expire_forget(x->mKey);
+            frozen_remove(x);
+            private_delete_node(x, update);
+            mDict.erase(x);
+            free_node(x);
+            removed++;
+            x = next;
+        }
+        return removed;
+    }
+
+    /* Delete all the elements with score between min and max from the skiplist.
+     * Min and max are inclusive, so a score >= min || score <= max is deleted.
+     * Note that this function takes the reference to the hash table view of the
+     * ordered set, in order to remove the elements from the hash table too. */
+    unsigned long private_delete_range_by_score(const RangeSpec &range) {
+        SkipListNode *update[SKIPLIST_MAXLEVEL], *x;
+        unsigned long removed = 0;
+        int i;
+
+        /* Every element is in range: drop them all at once. */
+        if (mLength > 0 && score_gte_min(mHeader->mLevel[0].mForward->mScore, range) &&
+            score_lte_max(mTail->mScore, range)) {
+            removed = mLength;
+            private_clear();
+            return removed;
+        }
+    
+        x = mHeader;
+        for (i = mLevel-1; i >= 0; i--) {
+            while (x->mLevel[i].mForward && 
+                (range.mMinex ? x->mLevel[i].forward_score() <= range.mMin 
+                              : x->mLevel[i].forward_score() < range.mMin))
+                x = x->mLevel[i].mForward;
+            update[i] = x;
+        }
+    
+        /* Current node is the last with score < or <= min. */
+        x = x->mLevel[0].mForward;
+
+        /* Delete nodes while in range. */
+        while (x && (range.mMaxex ? x->mScore < range.mMax : x->mScore <= range.mMax)) {
+            SkipListNode *next = x->mLevel[0].mForward;
+            expire_forget(x->mKey);
+            frozen_remove(x);
+            private_delete_node(x, update);
+            mDict.erase(x);
+            free_node(x);
+            removed++;
+            x = next;
+        }
+        return removed;
+    }
+
+    /* Delete all the elements with rank between start and end from the skiplist.
+     * Start and end are inclusive. Note that start and end need to be 1-based */
+    unsigned long private_delete_range_by_rank(unsigned long start, unsigned long end) {
+        SkipListNode *update[SKIPLIST_MAXLEVEL], *x;
+        unsigned long traversed = 0, removed = 0;
+        int i;
+
+        /* The whole skiplist is in range: drop every element at once. */
+        if (start <= 1 && end >= mLength) {
+            removed = mLength;
+            private_clear();
+            return removed;
+        }
+
+        x = mHeader;
+        for (i = mLevel-1; i >= 0; i--) {
+            while (x->mLevel[i].mForward && (traversed + x->mLevel[i].mSpan) < start) {
+                traversed += x->mLevel[i].mSpan;
+                x = x->mLevel[i].mForward;
+            }
+            update[i] = x;
+        }
+
+        traversed++;
+        x = x->mLevel[0].mForward;
+        while (x && traversed <= end) {
+            SkipListNode *next = x->mLevel[0].mForward;
+            expire_forget(x->mKey);
+            frozen_remove(x);
+            private_delete_node(x, update);
+            mDict.erase(x);
+            free_node(x);
+            removed++;
+            traversed++;
+            x = next;
+        }
+        return removed;
+    }
+
+    /* Find the rank of a node of the skiplist.
+     * Note that the rank is 1-based due to the span of mHeader to the
+     * first element. */
+    unsigned long get_rank(const SkipListNode *node) const {
+        SkipListNode *x;
+        ScoreType score = node->mScore;
+        unsigned long rank = 0, hops = 0, compares = 0;
+        int i;
+
+        x = mHeader;
+        for (i = mLevel-1; i >= 0; i--) {
+            while (x->mLevel[i].mForward && !forward_greater(x, i, score, node->mKey)) {
+                rank += x->mLevel[i].mSpan;
+                x = x->mLevel[i].mForward;
+                hops++;
+            }
+            compares += (x->mLevel[i].mForward != NULL);
+
+            if (x == node) {
+                mInstrument.on_descent(hops, hops + compares);
+                return rank;
+            }
+        }
+        assert(false); /* 'node' is always in the skiplist */
+        return 0;
+    }
+
+    /* Finds an element by its rank. The rank argument needs to be 1-based. */
+    SkipListNode* get_element_by_rank(unsigned long rank) const {
+        SkipListNode *x;
+        unsigned long traversed = 0;
+        int i;
+
+        x = mHeader;
+        for (i = mLevel-1; i >= 0; i--) {
+            while (x->mLevel[i].mForward && (traversed + x->mLevel[i].mSpan) <= rank)
+            {
+                traversed += x->mLevel[i].mSpan;
+                x = x->mLevel[i].mForward;
+            }
+            if (traversed == rank) {
+                return x;
+            }
+        }
+        return NULL;
+    }
+
+    /* 'key' is only copied (or moved) once, into its node, when it is new. */
+    template<typename K>
+    void zadd_generic(K &&key, ScoreType score, bool incr) {
+        expire_tick();
+        if (is_small()) {
+            long i = small_find(key);
+            if (i >= 0) {
+                ScoreType curscore = mSmall[i].second;
+                if (incr) {
+                    score += curscore;
+                }
+                if (score != curscore) {
+                    small_update_score(i, score);
+                }
+                mInstrument.on_update();
+                return;
+            }
+            if (capped_rejects(score, key)) {
+                return;
+            }
+            if (mSmall.size() < mCompactEntries && small_key_fits(key)) {
+                std::size_t pos = small_lower(score, key);
+                mSmall.insert(mSmall.begin() + pos, KeyScorePairType(std::forward<K>(key), score));
+                mInstrument.on_insert();
+                capped_trim();
+                return;
+            }
+            promote();
+        }
+        std::size_t hash = mDict.hash(key);
+        SkipListNode *x = mDict.find(key, hash);
+        if (x != NULL) {
+            ScoreType curscore = x->mScore;
+            if (incr) {
+                score += curscore;
+            }
+            if (score != curscore) {
+                frozen_update(x, score);
+                private_update_score(x, score);
+            }
+            mInstrument.on_update();
+        }
+        else if (!capped_rejects(score, key)) {
+            frozen_insert(key, score);
+            mDict.insert(private_insert(score, std::forward<K>(key)), hash);
+            mInstrument.on_insert();
+            capped_trim();
+        }
+    }
+    
+    /* Sanitize the indexes of a rank range: negative indexes count from the
+     * tail, just like Redis. Returns false when the range is empty. */
+    bool sanitize_rank_range(long &start, long &end) const {
+        return sanitize_rank_range(start, end, length());
+    }
+
+    static bool sanitize_rank_range(long &start, long &end, long llen) {
+        if (start < 0) start = llen+start;
+        if (end < 0) end = llen+end;
+        if (start < 0) start = 0;
+
+        /* Invariant: start >= 0, so this test will be true when end < 0.
+         * The range is empty when start > end or start >= length. */
+        if (start > end || start >= llen) {
+            return false;
+        }
+        if (end >= llen) end = llen-1;
+        return true;
+    }
+
+    /* The node at the 0-based index 'start', counted from the tail if reversed. */
+    SkipListNode* get_element_by_index(long start, bool reverse) const {
+        long llen = length();
+        SkipListNode *ln;
+        /* Check if starting point is trivial, before doing log(N) lookup. */
+        if (reverse) {
+            ln = mTail;
+            if (start > 0)
+                ln = get_element_by_rank(llen-start);
+        } else {
+            ln = mHeader->mLevel[0].mForward;
+            if (start > 0)
+                ln = get_element_by_rank(start+1);
+        }
+        return ln;
+    }
+
+    /* Reversed ranges take their bounds as (max, min), see zrevrangebyscore(). */
+    static RangeSpec score_range(ScoreType min, ScoreType max, bool reverse, bool minex, bool maxex) {
+        return RangeSpec((reverse?max:min), (reverse?min:max), (reverse?maxex:minex), (reverse?minex:maxex));
+    }
+
+    /* Calls fn(key, score) for every element between the ranks start and end. */
+    template<typename Fn>
+    void zrange_generic(long start, long end, bool reverse, Fn &fn) const {
+        if (!Instrument::ENABLED) {
+            private_zrange(start, end, reverse, fn);
+            return;
+        }
+        unsigned long long begin = instrument_clock();
+        std::size_t count = private_zrange(start, end, reverse, fn);
+        mInstrument.on_range(count, instrument_clock() - begin);
+    }
+
+    /* zrange_generic() itself, returns how many elements it went through. */
+    template<typename Fn>
+    std::size_t private_zrange(long start, long end, bool reverse, Fn &fn) const {
+        if (!sanitize_rank_range(start, end)) {
+            return 0;
+        }
+        unsigned long rangelen = (end-start)+1;
+        if (is_small()) {
+            long llen = length();
+            for (long i = start; i <= end; i++) {
+                const KeyScorePairType &e = mSmall[reverse ? llen-1-i : i];
+                fn(e.first, e.second);
+            }
+            return rangelen;
+        }
+        SkipListNode *ln = get_element_by_index(start, reverse);
+
+        for (unsigned long i = 0; i < rangelen; i++) {
+            assert(ln != NULL);
+            fn(ln->mKey, ln->mScore);
+            ln = reverse ? ln->mBackward : ln->mLevel[0].mForward;
+        }
+        return rangelen;
+    }
+
+    static unsigned long long instrument_clock() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    }
+
+    /* Calls fn(key, score) for every element with a score in the range,
+     * but the first 'offset' ones, and at most 'count' of them (no limit if
+     * negative), just like ZRANGEBYSCORE's LIMIT. The offset is skipped by
+     * rank with a span descent, not node by node, so a page costs
+     * O(log(N)+count) wherever it starts in the range. */
+    template<typename Fn>
+    void zrangebyscore_generic(ScoreType min, ScoreType max, bool reverse, Fn &fn, 
+                               bool minex = false, bool maxex = false,
+                               long offset = 0, long count = -1) const {
+        RangeSpec range = score_range(min, max, reverse, minex, maxex);
+        unsigned long limit = (count < 0) ? ULONG_MAX : count;
+        unsigned long rank;
+        SkipListNode *ln;
+
+        /* A negative offset matches nothing, like in Redis. */
+        if (offset < 0 || limit == 0) {
+            return;
+        }
+
+        if (is_small()) {
+            std::size_t first = small_score_bound(range, false), last = small_score_bound(range, true);
+            if (first >= last || last - first <= (std::size_t)offset) {
+                return;
+            }
+            if (reverse) last -= offset; else first += offset;
+            if (last - first > limit) {
+                if (reverse) first = last - limit; else last = first + limit;
+            }
+            for (std::size_t i = first; i < last; i++) {
+                const KeyScorePairType &e = mSmall[reverse ? first+last-1-i : i];
+                fn(e.first, e.second);
+            }
+            return;
+        }
+
+        /* If reversed, get the last node in range as starting point. */
+        if (reverse) {
+            ln = last_in_range(range, &rank);
+        } else {
+            ln = first_in_range(range, &rank);
+        }
+
+        /* No "first" element in the specified interval. */
+        if (ln == NULL) {
+            return;
+        }
+
+        /* Jump over the offset, an out of range landing is caught below. */
+        if (offset > 0) {
+            if (reverse) {
+                if (rank <= (unsigned long)offset) return;
+                ln = get_element_by_rank(rank - offset);
+            } else {
+                if (rank + offset > mLength) return;
+                ln = get_element_by_rank(rank + offset);
+            }
+        }
+
+        while (ln && limit--) {
+            /* Abort when the node is no longer in range. */
+            if (reverse) {
+                if (!score_gte_min(ln->mScore,range)) break;
+            } else {
+                if (!score_lte_max(ln->mScore,range)) break;
+            }
+
+            fn(ln->mKey, ln->mScore);
+
+            /* Move to next node */
+            if (reverse) {
+                ln = ln->mBackward;
+            } else {
+                ln = ln->mLevel[0].mForward;
+            }
+        }
+    }
+
+    /* Same as zrangebyscore_generic(), for lex ranges. min and max are the
+     * bounds of the range in skiplist order, even if reversed. */
+    template<typename Fn>
+    void zrangebylex_generic(const LexBound &min, const LexBound &max, bool reverse, Fn &fn,
+                             long offset = 0, long count = -1) const {
+        unsigned long limit = (count < 0) ? ULONG_MAX : count;
+        unsigned long rank;
+        SkipListNode *ln;
+
+        if (offset < 0 || limit == 0) {
+            return;
+        }
+
+        if (is_small()) {
+            std::size_t first = small_lex_bound(min, max, false), last = small_lex_bound(min, max, true);
+            if (first >= last || last - first <= (std::size_t)offset) {
+                return;
+            }
+            if (reverse) last -= offset; else first += offset;
+            if (last - first > limit) {
+                if (reverse) first = last - limit; else last = first + limit;
+            }
+            for (std::size_t i = first; i < last; i++) {
+                const KeyScorePairType &e = mSmall[reverse ? first+last-1-i : i];
+                fn(e.first, e.second);
+            }
+            return;
+        }
+
+        if (reverse) {
+            ln = last_in_lex_range(min, max, &rank);
+        } else {
+            ln = first_in_lex_range(min, max, &rank);
+        }
+        if (ln == NULL) {
+            return;
+        }
+
+        if (offset > 0) {
+            if (reverse) {
+                if (rank <= (unsigned long)offset) return;
+                ln = get_element_by_rank(rank - offset);
+            } else {
+                if (rank + offset > mLength) return;
+                ln = get_element_by_rank(rank + offset);
+            }
+        }
+
+        while (ln && limit--) {
+            if (reverse) {
+                if (!lex_gte_min(ln->mKey, min)) break;
+            } else {
+                if (!lex_lte_max(ln->mKey, max)) break;
+            }
+            fn(ln->mKey, ln->mScore);
+            ln = reverse ? ln->mBackward : ln->mLevel[0].mForward;
+        }
+    }
+
+    /* Visitors filling the result vectors of the range commands. */
+    class KeyCollector {
+    public:
+        KeyCollector(KeyVecType &result): mResult(result) { mResult.clear(); }
+        void operator()(const KeyType &key, ScoreType) { mResult.push_back(key); }
+    private:
+        KeyVecType &mResult;
+    };
+
+    class KeyScoreCollector {
+    public:
+        KeyScoreCollector(KeyScoreVecType &result): mResult(result) { mResult.clear(); }
+        void operator()(const KeyType &key, ScoreType score) { mResult.push_back(std::make_pair(key, score)); }
+    private:
+        KeyScoreVecType &mResult;
+    };
+
+    void zpop_generic(bool max, long count, KeyScoreVecType &result) {
+        result.clear();
+        if (count <= 0)
+            return;
+        result.resize(std::min((unsigned long)count, length()));
+        for (std::size_t i = 0; i < result.size(); i++)
+            private_pop(max, &result[i].first, &result[i].second);
+        maybe_demote();
+    }
+
+    bool zrank_generic(const KeyType &key, bool reverse, unsigned long &rank) const {
+        unsigned long llen = length();
+        if (is_small()) {
+            long i = small_find(key);
+            if (i < 0) {
+                return false;
+            }
+            rank = reverse ? llen-1-i : i;
+            return true;
+        }
+        SkipListNode *x = mDict.find(key);
+        if (x != NULL) {
+            rank = get_rank(x);
+            if (reverse) {
+                rank = llen - rank;
+            }
+            else {
+                rank -= 1;
+            }
+            return true;
+        }
+        else {
+            return false;
+        }
+    }
+
+public:
+    /* Bidirectional iterators over the elements in rank order (reversed for
+     * Reverse=true), dereferencing gives the key, score() gives its score.
+     * Nothing is copied, but any change to the set invalidates them. On sets
+     * in the compact encoding they walk mSmall instead of the nodes, reverse
+     * ones pointing one entry past the one they give. */
+    template<bool Reverse>
+    class Iterator {
+    public:
+        typedef std::bidirectional_iterator_tag iterator_category;
+        typedef KeyType value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef const KeyType *pointer;
+        typedef const KeyType &reference;
+
+        Iterator(): mNode(NULL), mEntry(NULL), mSet(NULL) {}
+
+        reference operator*() const { return key(); }
+        pointer operator->() const { return &key(); }
+        const KeyType& key() const { return mEntry ? entry().first : mNode->mKey; }
+        ScoreType score() const { return mEntry ? entry().second : mNode->mScore; }
+
+        Iterator& operator++() {
+            if (mEntry)
+                mEntry += Reverse ? -1 : 1;
+            else
+                mNode = Reverse ? mNode->mBackward : mNode->mLevel[0].mForward;
+            return *this;
+        }
+
+        Iterator& operator--() {
+            /* Stepping back from the end lands on the last element. */
+            if (mEntry)
+                mEntry += Reverse ? 1 : -1;
+            else if (mNode == NULL)
+                mNode = Reverse ? mSet->mHeader->mLevel[0].mForward : mSet->mTail;
+            else
+                mNode = Reverse ? mNode->mLevel[0].mForward : mNode->mBackward;
+            return *this;
+        }
+
+        /* Move 'n' elements on, or to the end. Forward iterators on the
+         * skiplist jump along the highest level of every node they meet that
+         * does not overshoot, in O(log(n)): paging through a set with one
+         * iterator never searches it from mHeader again. Reverse ones have
+         * only mBackward, they go through the element's rank in O(log(N)). */
+        Iterator& skip(unsigned long n) {
+            if (mSet->is_small()) {
+                const KeyScorePairType *first = mSet->mSmall.data();
+                std::size_t left = Reverse ? mEntry - first : first + mSet->mSmall.size() - mEntry;
+                n = std::min(n, (unsigned long)left);
+                mEntry = Reverse ? mEntry - n : mEntry + n;
+            }
+            else if (Reverse) {
+                if (mNode != NULL && n > 0) {
+                    unsigned long rank = mSet->get_rank(mNode);
+                    mNode = (rank > n) ? mSet->get_element_by_rank(rank - n) : NULL;
+                }
+            }
+            else {
+                while (mNode != NULL && n > 0) {
+                    int i = mNode->mLevelCount - 1;
+                    while (i > 0 && (mNode->mLevel[i].mForward == NULL || mNode->mLevel[i].mSpan > n))
+                        i--;
+                    n -= mNode->mLevel[i].mSpan;
+                    mNode = mNode->mLevel[i].mForward;
+                }
+            }
+            return *this;
+        }
+
+        Iterator operator++(int) { Iterator tmp(*this); ++*this; return tmp; }
+        Iterator operator--(int) { Iterator tmp(*this); --*this; return tmp; }
+        bool operator==(const Iterator &other) const { return mNode == other.mNode && mEntry == other.mEntry; }
+        bool operator!=(const Iterator &other) const { return !(*this == other); }
+
+    private:
+        friend class SortedSet;
+        Iterator(const SkipListNode *node, const SortedSet *set): mNode(node), mEntry(NULL), mSet(set) {}
+        Iterator(const KeyScorePairType *entry, const SortedSet *set): mNode(NULL), mEntry(entry), mSet(set) {}
+
+        const KeyScorePairType& entry() const { return Reverse ? mEntry[-1] : *mEntry; }
+
+        const SkipListNode *mNode;
+        const KeyScorePairType *mEntry;
+        const SortedSet *mSet;
+    };
+
+    /* A [begin, end) pair of iterators, usable in a range-based for loop. */
+    template<typename IteratorType>
+    class View {
+    public:
+        View(IteratorType first, IteratorType last): mBegin(first), mEnd(last) {}
+        IteratorType begin() const { return mBegin; }
+        IteratorType end() const { return mEnd; }
+        bool empty() const { return mBegin == mEnd; }
+    private:
+        IteratorType mBegin, mEnd;
+    };
+
+    typedef Iterator<false> const_iterator;
+    typedef Iterator<true> const_reverse_iterator;
+    typedef View<const_iterator> RangeViewType;
+    typedef View<const_reverse_iterator> ReverseRangeViewType;
+
+    /* A frozen, point in time view of a set: it keeps showing the elements
+     * the set had when the view was created, while the set keeps changing,
+     * so a long scan paging through it never sees a member twice or misses
+     * one. Nothing is copied upfront: the first change of a member after
+     * the view was created saves its old state into the view (mOld), and
+     * the view tracks the current state of every member changed since then
+     * (mNew). The frozen set is the live skiplist minus mNew plus mOld, its
+     * ranks are counted from the spans of the three skiplists, so rank
+     * queries cost O(log(N)^2) and scores queries O(log(N)). Writes only do
+     * extra work while views exist. The view must be destroyed before its
+     * set, and the set must not change while the view is read. */
+    class FrozenView {
+    public:
+        FrozenView(SortedSet &set)
+            : mSet(&set), mPrev(NULL), mNext(set.mFrozen), mOld(new SortedSet), mNew(new SortedSet)
+        {
+            /* Views work on the skiplists. */
+            if (set.is_small())
+                set.promote();
+            mOld->set_compact_limits(0, 0);
+            mNew->set_compact_limits(0, 0);
+            if (mNext != NULL)
+                mNext->mPrev = this;
+            set.mFrozen = this;
+        }
+
+        ~FrozenView()
+        {
+            if (mPrev != NULL)
+                mPrev->mNext = mNext;
+            else
+                mSet->mFrozen = mNext;
+            if (mNext != NULL)
+                mNext->mPrev = mPrev;
+            delete mOld;
+            delete mNew;
+        }
+
+        void zrange(long start, long end, KeyVecType &result) const {
+            KeyCollector collect(result);
+            zrange_generic(start, end, false, collect);
+        }
+
+        void zrevrange(long start, long end, KeyVecType &result) const {
+            KeyCollector collect(result);
+            zrange_generic(start, end, true, collect);
+        }
+
+        void zrange_withscores(long start, long end, KeyScoreVecType &result) const {
+            KeyScoreCollector collect(result);
+            zrange_generic(start, end, false, collect);
+        }
+
+        void zrevrange_withscores(long start, long end, KeyScoreVecType &result) const {
+            KeyScoreCollector collect(result);
+            zrange_generic(start, end, true, collect);
+        }
+
+        void zrangebyscore(ScoreType min, ScoreType max, KeyVecType &result, bool minex = false, bool maxex = false) const {
+            KeyCollector collect(result);
+            zrangebyscore_generic(min, max, false, collect, minex, maxex);
+        }
+
+        void zrevrangebyscore(ScoreType min, ScoreType max, KeyVecType &result, bool minex = false, bool maxex = false) const {
+            KeyCollector collect(result);
+            zrangebyscore_generic(min, max, true, collect, minex, maxex);
+        }
+
+        void zrangebyscore_withscores(ScoreType min, ScoreType max, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+            KeyScoreCollector collect(result);
+            zrangebyscore_generic(min, max, false, collect, minex, maxex);
+        }
+
+        void zrevrangebyscore_withscores(ScoreType min, ScoreType max, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+            KeyScoreCollector collect(result);
+            zrangebyscore_generic(min, max, true, collect, minex, maxex);
+        }
+
+        template<typename Fn>
+        void zrange(long start, long end, Fn fn) const {
+            zrange_generic(start, end, false, fn);
+        }
+
+        template<typename Fn>
+        void zrevrange(long start, long end, Fn fn) const {
+            zrange_generic(start, end, true, fn);
+        }
+
+        template<typename Fn>
+        void zrangebyscore(ScoreType min, ScoreType max, Fn fn, bool minex = false, bool maxex = false) const {
+            zrangebyscore_generic(min, max, false, fn, minex, maxex);
+        }
+
+        template<typename Fn>
+        void zrevrangebyscore(ScoreType min, ScoreType max, Fn fn, bool minex = false, bool maxex = false) const {
+            zrangebyscore_generic(min, max, true, fn, minex, maxex);
+        }
+
+        unsigned long zcount(ScoreType min, ScoreType max, bool minex = false, bool maxex = false) const {
+            return mSet->zcount(min, max, minex, maxex) - mNew->zcount(min, max, minex, maxex)
+                   + mOld->zcount(min, max, minex, maxex);
+        }
+
+        unsigned long zcard() const {
+            return mSet->length() - mNew->length() + mOld->length();
+        }
+
+        bool zscore(const KeyType &key, ScoreType &score) const {
+            if (mOld->zscore(key, score))
+                return true;
+            /* Changed, but not there when the view was created: added since. */
+            if (mNew->mDict.find(key) != NULL)
+                return false;
+            return mSet->zscore(key, score);
+        }
+
+        bool zrank(const KeyType &key, unsigned long &rank) const {
+            return zrank_generic(key, false, rank);
+        }
+
+        bool zrevrank(const KeyType &key, unsigned long &rank) const {
+            return zrank_generic(key, true, rank);
+        }
+
+    private:
+        friend class SortedSet;
+
+        FrozenView(const FrozenView&);
+        FrozenView& operator=(const FrozenView&);
+
+        /* Number of frozen elements sorting before (score, key). */
+        unsigned long count_before(ScoreType score, const KeyType &key) const {
+            return mSet->count_before(score, key) - mNew->count_before(score, key)
+                   + mOld->count_before(score, key);
+        }
+
+        /* Skip the live nodes changed since the view was created. */
+        const SkipListNode* visible(const SkipListNode *x, bool reverse) const {
+            while (x != NULL && mNew->mDict.find(x->mKey) != NULL)
+                x = reverse ? x->mBackward : x->mLevel[0].mForward;
+            return x;
+        }
+
+        /* The first node of 'set' (the live set or mOld) with at least 'rank'
+         * frozen elements before it, NULL if there is none. That count only
+         * grows along a skiplist, so this is a binary search on the ranks. */
+        const SkipListNode* seek(const SortedSet *set, unsigned long rank) const {
+            unsigned long lo = 1, hi = set->length() + 1;
+            while (lo < hi) {
+                unsigned long mid = lo + (hi - lo) / 2;
+                const SkipListNode *x = set->get_element_by_rank(mid);
+                if (count_before(x->mScore, x->mKey) >= rank)
+                    hi = mid;
+                else
+                    lo = mid + 1;
+            }
+            return (lo <= set->length()) ? set->get_element_by_rank(lo) : NULL;
+        }
+
+        /* Merge the visible live nodes from 'live' with the saved ones from
+         * 'old', calling fn(key, score) on at most 'count' elements, until
+         * one is past the end of 'range' if there is one. */
+        template<typename Fn>
+        void merge(const SkipListNode *live, const SkipListNode *old, bool reverse,
+                   const RangeSpec *range, unsigned long count, Fn &fn) const {
+            live = visible(live, reverse);
+            while (count > 0 && (live != NULL || old != NULL)) {
+                bool fromlive = old == NULL || (live != NULL &&
+                    (reverse ? mSet->node_greater(live, old->mScore, old->mKey)
+                             : mSet->node_less(live, old->mScore, old->mKey)));
+                const SkipListNode *x = fromlive ? live : old;
+                if (range != NULL &&
+                    !(reverse ? score_gte_min(x->mScore, *range) : score_lte_max(x->mScore, *range)))
+                    break;
+                fn(x->mKey, x->mScore);
+                count--;
+                if (fromlive)
+                    live = visible(reverse ? live->mBackward : live->mLevel[0].mForward, reverse);
+                else
+                    old = reverse ? old->mBackward : old->mLevel[0].mForward;
+            }
+        }
+
+        template<typename Fn>
+        void zrange_generic(long start, long end, bool reverse, Fn &fn) const {
+            long llen = zcard();
+            const SkipListNode *live, *old;
+            if (!sanitize_rank_range(start, end, llen)) {
+                return;
+            }
+            if (reverse) {
+                /* The last nodes with at most llen-1-start elements before them. */
+                unsigned long rank = llen - start;
+                live = seek(mSet, rank);
+                live = live ? live->mBackward : mSet->mTail;
+                old = seek(mOld, rank);
+                old = old ? old->mBackward : mOld->mTail;
+            }
+            else {
+                live = seek(mSet, start);
+                old = seek(mOld, start);
+            }
+            merge(live, old, reverse, NULL, (end-start)+1, fn);
+        }
+
+        template<typename Fn>
+        void zrangebyscore_generic(ScoreType min, ScoreType max, bool reverse, Fn &fn,
+                                   bool minex, bool maxex) const {
+            RangeSpec range = score_range(min, max, reverse, minex, maxex);
+            if (reverse)
+                merge(mSet->last_in_range(range), mOld->last_in_range(range), true, &range, ULONG_MAX, fn);
+            else
+                merge(mSet->first_in_range(range), mOld->first_in_range(range), false, &range, ULONG_MAX, fn);
+        }
+
+        bool zrank_generic(const KeyType &key, bool reverse, unsigned long &rank) const {
+            ScoreType score;
+            if (!zscore(key, score))
+                return false;
+            rank = count_before(score, key);
+            if (reverse)
+                rank = zcard() - 1 - rank;
+            return true;
+        }
+
+        SortedSet *mSet;
+        FrozenView *mPrev, *mNext;
+        /* Members changed since the view was created: their state back then
+         * (if they were there), and their current state (if they still are). */
+        SortedSet *mOld, *mNew;
+    };
+
+public:
+    void zadd(const KeyType &key, ScoreType score) {
+        zadd_generic(key, score, false);
+    }
+
+    void zadd(KeyType &&key, ScoreType score) {
+        zadd_generic(std::move(key), score, false);
+    }
+    
+    void zincrby(const KeyType &key, ScoreType score) {
+        zadd_generic(key, score, true);
+    }
+
+    void zincrby(KeyType &&key, ScoreType score) {
+        zadd_generic(std::move(key), score, true);
+    }
+
+    /* Add (or update) many elements at once. New elements are sorted first
+     * and then linked in a single forward walk of the skiplist, so a batch
+     * already in score order costs close to O(count). For keys given more
+     * than once the last score wins, just like repeated zadd() calls. A
+     * bounded set takes the whole batch first, then evicts what is past its
+     * capacity. */
+    void zadd_many(const KeyScorePairType *items, std::size_t count) {
+        std::vector<SkipListNode*> fresh;
+        std::size_t i;
+
+        if (is_small()) {
+            if (mSmall.size() + count <= mCompactEntries) {
+                unsigned long capacity = mCapacity;
+                mCapacity = 0;
+                for (i = 0; i < count; i++)
+                    zadd_generic(items[i].first, items[i].second, false);
+                mCapacity = capacity;
+                capped_trim();
+                return;
+            }
+            promote();
+        }
+        mDict.reserve(mDict.size() + count);
+        for (i = 0; i < count; i++) {
+            const KeyType &key = items[i].first;
+            ScoreType score = items[i].second;
+            std::size_t hash = mDict.hash(key);
+            SkipListNode *x = mDict.find(key, hash);
+            if (x == NULL) {
+                /* Not linked in the skiplist yet, flagged by mBackward pointing
+                 * to the node itself until then. */
+                frozen_insert(key, score);
+                x = create_node(randomlevel(), score, key);
+                x->mBackward = x;
+                mDict.insert(x, hash);
+                fresh.push_back(x);
+            }
+            else if (x->mBackward == x) {
+                frozen_insert(key, score);
+                x->mScore = score;
+            }
+            else if (x->mScore != score) {
+                frozen_update(x, score);
+                private_update_score(x, score);
+            }
         }
-        /* We may have multiple elements with the same score, what we need
-         * is to find the element with both the right score and key. */
-        x = x->mLevel[0].mForward;
-        if (x && score == x->mScore && x->mKey == key) {
-            private_delete_node(x, update);
-            delete x;
-            return true;
-        } 
-        else {
-            return false; /* not found */
+
+        std::sort(fresh.begin(), fresh.end(), NodeLess(this));
+        Finger finger;
+        finger_reset(finger);
+        for (i = 0; i < fresh.size(); i++) {
+            private_insert_node(fresh[i], finger);
         }
-        return false; /* not found */
+        capped_trim();
     }
 
-    static bool score_gte_min(double score, const RangeSpec &spec) {
-        return spec.mMinex ? (score > spec.mMin) : (score >= spec.mMin);
+    void zadd_many(const KeyScoreVecType &items) {
+        if (!items.empty())
+            zadd_many(&items[0], items.size());
     }
 
-    static bool score_lte_max(double score, const RangeSpec &spec) {
-        return spec.mMaxex ? (score < spec.mMax) : (score <= spec.mMax);
+    /* Remove many elements at once, in a single forward walk of the skiplist. */
+    void zrem_many(const KeyType *keys, std::size_t count) {
+        std::vector<SkipListNode*> doomed;
+        std::size_t i;
+
+        if (is_small()) {
+            for (i = 0; i < count; i++)
+                zrem(keys[i]);
+            return;
+        }
+        for (i = 0; i < count; i++) {
+            SkipListNode *x = mDict.find(keys[i]);
+            if (x != NULL) {
+                expire_forget(keys[i]);
+                frozen_remove(x);
+                mDict.erase(x);
+                doomed.push_back(x);
+            }
+        }
+
+        std::sort(doomed.begin(), doomed.end(), NodeLess(this));
+        Finger finger;
+        finger_reset(finger);
+        for (i = 0; i < doomed.size(); i++) {
+            private_delete(doomed[i], finger);
+            free_node(doomed[i]);
+        }
+        maybe_demote();
     }
 
-    /* Returns if there is a part of the skiplist is in range. */
-    bool is_in_range(const RangeSpec &range) {
-        SkipListNode *x;
-        /* Test for ranges that will always be empty. */
-        if (range.mMin > range.mMax || (range.mMin == range.mMax && (range.mMinex || range.mMaxex)))
-            return false;
-        x = mTail;
-        if (x == NULL || !score_gte_min(x->mScore, range))
-            return false;
-        x = mHeader->mLevel[0].mForward;
-        if (x == NULL || !score_lte_max(x->mScore, range))
-            return false;
-        return true;
+    void zrem_many(const KeyVecType &keys) {
+        if (!keys.empty())
+            zrem_many(&keys[0], keys.size());
     }
 
-    /* Find the first node that is contained in the specified range.
-     * Returns NULL when no element is contained in the range. */
-    SkipListNode* first_in_range(const RangeSpec &range) {
-        SkipListNode *x;
-        int i;
-    
-        /* If everything is out of range, return early. */
-        if (!is_in_range(range)) return NULL;
-    
-        x = mHeader;
-        for (i = mLevel-1; i >= 0; i--) {
-            /* Go forward while *OUT* of range. */
-            while (x->mLevel[i].mForward && !score_gte_min(x->mLevel[i].mForward->mScore, range))
-                x = x->mLevel[i].mForward;
+    void zrem(const KeyType &key) {
+        expire_tick();
+        private_zrem(key);
+    }
+
+    void zremrangebyscore(ScoreType min, ScoreType max, bool minex = false, bool maxex = false) {
+        RangeSpec range(min, max, minex, maxex);
+        if (is_small()) {
+            std::size_t first = small_score_bound(range, false), last = small_score_bound(range, true);
+            if (first < last) {
+                expire_forget(first, last);
+                mSmall.erase(mSmall.begin() + first, mSmall.begin() + last);
+            }
+            return;
         }
-    
-        /* This is an inner range, so the next node cannot be NULL. */
-        x = x->mLevel[0].mForward;
-        assert(x != NULL);
+        private_delete_range_by_score(range);
+        maybe_demote();
+    }
 
-        /* Check if score <= max. */
-        if (!score_lte_max(x->mScore, range)) return NULL;
-        return x;
+    void zremrangebyrank(long start, long end) {
+        if (!sanitize_rank_range(start, end)) {
+            return;
+        }
+        if (is_small()) {
+            expire_forget(start, end + 1);
+            mSmall.erase(mSmall.begin() + start, mSmall.begin() + end + 1);
+            return;
+        }
+        /* Correct for 1-based rank. */
+        private_delete_range_by_rank(start+1, end+1);
+        maybe_demote();
     }
 
-    /* Find the last node that is contained in the specified range.
-     * Returns NULL when no element is contained in the range. */
-    SkipListNode* last_in_range(const RangeSpec &range) {
-        SkipListNode *x;
-        int i;
+    void zrange(long start, long end, KeyVecType &result) const {
+        KeyCollector collect(result);
+        zrange_generic(start, end, false, collect);
+    }
     
-        /* If everything is out of range, return early. */
-        if (!is_in_range(range)) return NULL;
+    void zrevrange(long start, long end, KeyVecType &result) const {
+        KeyCollector collect(result);
+        zrange_generic(start, end, true, collect);
+    }
     
-        x = mHeader;
-        for (i = mLevel-1; i >= 0; i--) {
-            /* Go forward while *IN* range. */
-            while (x->mLevel[i].mForward && score_lte_max(x->mLevel[i].mForward->mScore, range))
-                x = x->mLevel[i].mForward;
-        }
+    void zrange_withscores(long start, long end, KeyScoreVecType &result) const {
+        KeyScoreCollector collect(result);
+        zrange_generic(start, end, false, collect);
+    }
     
-        /* This is an inner range, so this node cannot be NULL. */
-        assert(x != NULL);
+    void zrevrange_withscores(long start, long end, KeyScoreVecType &result) const {
+        KeyScoreCollector collect(result);
+        zrange_generic(start, end, true, collect);
+    }
     
-        /* Check if score >= min. */
-        if (!score_gte_min(x->mScore, range)) return NULL;
-        return x;
+    void zrangebyscore(ScoreType min, ScoreType max, KeyVecType &result, bool minex = false, bool maxex = false) const {
+        KeyCollector collect(result);
+        zrangebyscore_generic(min, max, false, collect, minex, maxex);
     }
-
-    /* Delete all the elements with score between min and max from the skiplist.
-     * Min and max are inclusive, so a score >= min || score <= max is deleted.
-     * Note that this function takes the reference to the hash table view of the
-     * ordered set, in order to remove the elements from the hash table too. */
-    unsigned long private_delete_range_by_score(const RangeSpec &range) {
-        SkipListNode *update[SKIPLIST_MAXLEVEL], *x;
-        unsigned long removed = 0;
-        int i;
     
-        x = mHeader;
-        for (i = mLevel-1; i >= 0; i--) {
-            while (x->mLevel[i].mForward && 
-                (range.mMinex ? x->mLevel[i].mForward->mScore <= range.mMin 
-                              : x->mLevel[i].mForward->mScore < range.mMin))
-                x = x->mLevel[i].mForward;
-            update[i] = x;
-        }
+    void zrevrangebyscore(ScoreType min, ScoreType max, KeyVecType &result, bool minex = false, bool maxex = false) const {
+        KeyCollector collect(result);
+        zrangebyscore_generic(min, max, true, collect, minex, maxex);
+    }
     
-        /* Current node is the last with score < or <= min. */
-        x = x->mLevel[0].mForward;
+    void zrangebyscore_withscores(ScoreType min, ScoreType max, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+        KeyScoreCollector collect(result);
+        zrangebyscore_generic(min, max, false, collect, minex, maxex);
+    }
+    
+    void zrevrangebyscore_withscores(ScoreType min, ScoreType max, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+        KeyScoreCollector collect(result);
+        zrangebyscore_generic(min, max, true, collect, minex, maxex);
+    }
 
-        /* Delete nodes while in range. */
-        while (x && (range.mMaxex ? x->mScore < range.mMax : x->mScore <= range.mMax)) {
-            SkipListNode *next = x->mLevel[0].mForward;
-            private_delete_node(x, update);
-            mDict.erase(x->mKey);
-            delete x;
-            removed++;
-            x = next;
-        }
-        return removed;
+    /* Visitor flavours of the range commands: fn(key, score) is called for
+     * every element in the range, in order, nothing is copied. */
+    template<typename Fn>
+    void zrange(long start, long end, Fn fn) const {
+        zrange_generic(start, end, false, fn);
     }
 
-    /* Delete all the elements with rank between start and end from the skiplist.
-     * Start and end are inclusive. Note that start and end need to be 1-based */
-    unsigned long private_delete_range_by_rank(unsigned int start, unsigned int end) {
-        SkipListNode *update[SKIPLIST_MAXLEVEL], *x;
-        unsigned long traversed = 0, removed = 0;
-        int i;
+    template<typename Fn>
+    void zrevrange(long start, long end, Fn fn) const {
+        zrange_generic(start, end, true, fn);
+    }
 
-        x = mHeader;
-        for (i = mLevel-1; i >= 0; i--) {
-            while (x->mLevel[i].mForward && (traversed + x->mLevel[i].mSpan) < start) {
-                traversed += x->mLevel[i].mSpan;
-                x = x->mLevel[i].mForward;
-            }
-            update[i] = x;
-        }
+    template<typename Fn>
+    void zrangebyscore(ScoreType min, ScoreType max, Fn fn, bool minex = false, bool maxex = false) const {
+        zrangebyscore_generic(min, max, false, fn, minex, maxex);
+    }
 
-        traversed++;
-        x = x->mLevel[0].mForward;
-        while (x && traversed <= end) {
-            SkipListNode *next = x->mLevel[0].mForward;
-            private_delete_node(x, update);
-            mDict.erase(x->mKey);
-            delete x;
-            removed++;
-            traversed++;
-            x = next;
-        }
-        return removed;
+    template<typename Fn>
+    void zrevrangebyscore(ScoreType min, ScoreType max, Fn fn, bool minex = false, bool maxex = false) const {
+        zrangebyscore_generic(min, max, true, fn, minex, maxex);
     }
 
-    /* Find the rank for an element by both score and key.
-     * Returns 0 when the element cannot be found, rank otherwise.
-     * Note that the rank is 1-based due to the span of mHeader to the
-     * first element. */
-    unsigned long get_rank(double score, KeyType key) {
-        SkipListNode *x;
-        unsigned long rank = 0;
-        int i;
+    /* The range commands by score with LIMIT offset count: at most 'count'
+     * elements (all of them if negative) after the first 'offset' ones. */
+    void zrangebyscore_limit(ScoreType min, ScoreType max, long offset, long count, KeyVecType &result, bool minex = false, bool maxex = false) const {
+        KeyCollector collect(result);
+        zrangebyscore_generic(min, max, false, collect, minex, maxex, offset, count);
+    }
 
-        x = mHeader;
-        for (i = mLevel-1; i >= 0; i--) {
-            while (x->mLevel[i].mForward && x->mLevel[i].mForward->mScore <= score) {
-                rank += x->mLevel[i].mSpan;
-                x = x->mLevel[i].mForward;
-            }
+    void zrevrangebyscore_limit(ScoreType min, ScoreType max, long offset, long count, KeyVecType &result, bool minex = false, bool maxex = false) const {
+        KeyCollector collect(result);
+        zrangebyscore_generic(min, max, true, collect, minex, maxex, offset, count);
+    }
 
-            /* x might be equal to mHeader, so test if is header */
-            if (not x->mIsHeader && x->mKey == key) {
-                return rank;
-            }
-        }
-        return 0;
+    void zrangebyscore_withscores_limit(ScoreType min, ScoreType max, long offset, long count, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+        KeyScoreCollector collect(result);
+        zrangebyscore_generic(min, max, false, collect, minex, maxex, offset, count);
     }
 
-    /* Finds an element by its rank. The rank argument needs to be 1-based. */
-    SkipListNode* get_element_by_rank(unsigned long rank) {
-        SkipListNode *x;
-        unsigned long traversed = 0;
-        int i;
+    void zrevrangebyscore_withscores_limit(ScoreType min, ScoreType max, long offset, long count, KeyScoreVecType &result, bool minex = false, bool maxex = false) const {
+        KeyScoreCollector collect(result);
+        zrangebyscore_generic(min, max, true, collect, minex, maxex, offset, count);
+    }
 
-        x = mHeader;
-        for (i = mLevel-1; i >= 0; i--) {
-            while (x->mLevel[i].mForward && (traversed + x->mLevel[i].mSpan) <= rank)
-            {
-                traversed += x->mLevel[i].mSpan;
-                x = x->mLevel[i].mForward;
-            }
-            if (traversed == rank) {
-                return x;
-            }
-        }
-        return NULL;
+    template<typename Fn>
+    void zrangebyscore_limit(ScoreType min, ScoreType max, long offset, long count, Fn fn, bool minex = false, bool maxex = false) const {
+        zrangebyscore_generic(min, max, false, fn, minex, maxex, offset, count);
     }
 
-    void zadd_generic(KeyType key, double score, bool incr) {
-        DictTypeIterator it = mDict.find(key);
-        if (it != mDict.end()) {
-            double curscore = it->second;
-            if (incr) {
-                score += curscore;
-            }
-            if (score != curscore) {
-                private_delete(curscore, key);
-                private_insert(score, key);
-                mDict[key] = score;
-            }
+    template<typename Fn>
+    void zrevrangebyscore_limit(ScoreType min, ScoreType max, long offset, long count, Fn fn, bool minex = false, bool maxex = false) const {
+        zrangebyscore_generic(min, max, true, fn, minex, maxex, offset, count);
+    }
+
+    /* The lex range commands, see LexBound. Like in Redis, they are meant for
+     * sets whose elements all have the same score, and the reversed ones take
+     * their bounds as (max, min). */
+    void zrangebylex(const LexBound &min, const LexBound &max, KeyVecType &result) const {
+        KeyCollector collect(result);
+        zrangebylex_generic(min, max, false, collect);
+    }
+
+    void zrevrangebylex(const LexBound &max, const LexBound &min, KeyVecType &result) const {
+        KeyCollector collect(result);
+        zrangebylex_generic(min, max, true, collect);
+    }
+
+    void zrangebylex_limit(const LexBound &min, const LexBound &max, long offset, long count, KeyVecType &result) const {
+        KeyCollector collect(result);
+        zrangebylex_generic(min, max, false, collect, offset, count);
+    }
+
+    void zrevrangebylex_limit(const LexBound &max, const LexBound &min, long offset, long count, KeyVecType &result) const {
+        KeyCollector collect(result);
+        zrangebylex_generic(min, max, true, collect, offset, count);
+    }
+
+    template<typename Fn>
+    void zrangebylex(const LexBound &min, const LexBound &max, Fn fn) const {
+        zrangebylex_generic(min, max, false, fn);
+    }
+
+    template<typename Fn>
+    void zrevrangebylex(const LexBound &max, const LexBound &min, Fn fn) const {
+        zrangebylex_generic(min, max, true, fn);
+    }
+
+    template<typename Fn>
+    void zrangebylex_limit(const LexBound &min, const LexBound &max, long offset, long count, Fn fn) const {
+        zrangebylex_generic(min, max, false, fn, offset, count);
+    }
+
+    template<typename Fn>
+    void zrevrangebylex_limit(const LexBound &max, const LexBound &min, long offset, long count, Fn fn) const {
+        zrangebylex_generic(min, max, true, fn, offset, count);
+    }
+
+    unsigned long zlexcount(const LexBound &min, const LexBound &max) const {
+        unsigned long first, last;
+        if (is_small()) {
+            std::size_t begin = small_lex_bound(min, max, false), end = small_lex_bound(min, max, true);
+            return (begin < end) ? end - begin : 0;
         }
-        else {
-            private_insert(score, key);
-            mDict[key] = score;
+        if (first_in_lex_range(min, max, &first) == NULL || last_in_lex_range(min, max, &last) == NULL) {
+            return 0;
         }
+        return last - first + 1;
     }
-    
-    void zrange_generic(long start, long end, bool reverse, KeyVecType &result) {
-        result.clear();
 
-        /* Sanitize indexes. */
-        long llen = length();
-        if (start < 0) start = llen+start;
-        if (end < 0) end = llen+end;
-        if (start < 0) start = 0;
+    /* ZPOPMIN and ZPOPMAX: remove the 'count' lowest (highest) scored
+     * elements, returned in the order they were popped. */
+    void zpopmin(long count, KeyScoreVecType &result) {
+        zpop_generic(false, count, result);
+    }
 
-        /* Invariant: start >= 0, so this test will be true when end < 0.
-         * The range is empty when start > end or start >= length. */
-        if (start > end || start >= llen) {
-            return;
-        }
-        if (end >= llen) end = llen-1;
-        unsigned long rangelen = (end-start)+1;
+    void zpopmax(long count, KeyScoreVecType &result) {
+        zpop_generic(true, count, result);
+    }
 
-        SkipListNode *ln;
-        /* Check if starting point is trivial, before doing log(N) lookup. */
-        if (reverse) {
-            ln = mTail;
-            if (start > 0)
-                ln = get_element_by_rank(llen-start);
-        } else {
-            ln = mHeader->mLevel[0].mForward;
-            if (start > 0)
-                ln = get_element_by_rank(start+1);
-        }
+    /* Pop a single element, false if the set is empty. */
+    bool zpopmin(KeyType &key, ScoreType &score) {
+        if (length() == 0)
+            return false;
+        private_pop(false, &key, &score);
+        return true;
+    }
 
-        while(rangelen--) {
-            assert(ln != NULL);
-            result.push_back(ln->mKey);
-            ln = reverse ? ln->mBackward : ln->mLevel[0].mForward;
-        }
+    bool zpopmax(KeyType &key, ScoreType &score) {
+        if (length() == 0)
+            return false;
+        private_pop(true, &key, &score);
+        return true;
     }
 
-    void zrange_withscores_generic(long start, long end, bool reverse, KeyScoreVecType &result) {
-        result.clear();
+    /* ZUNIONSTORE and ZINTERSTORE, with this set as the destination: its
+     * elements are replaced by the union (or the intersection) of the
+     * 'count' sets, which may include this one. 'weights' (NULL for all 1)
+     * multiply the scores of each input before they are aggregated. Both
+     * return the number of elements of the result. */
+    unsigned long zunionstore(const SortedSet *const *sets, std::size_t count,
+                              const ScoreType *weights = NULL, Aggregate aggregate = AGGREGATE_SUM) {
+        return zstore_generic(sets, count, weights, aggregate, false);
+    }
 
-        /* Sanitize indexes. */
-        long llen = length();
-        if (start < 0) start = llen+start;
-        if (end < 0) end = llen+end;
-        if (start < 0) start = 0;
+    unsigned long zinterstore(const SortedSet *const *sets, std::size_t count,
+                              const ScoreType *weights = NULL, Aggregate aggregate = AGGREGATE_SUM) {
+        return zstore_generic(sets, count, weights, aggregate, true);
+    }
 
-        /* Invariant: start >= 0, so this test will be true when end < 0.
-         * The range is empty when start > end or start >= length. */
-        if (start > end || start >= llen) {
+    unsigned long zunionstore(const std::vector<const SortedSet*> &sets,
+                              const std::vector<ScoreType> &weights = std::vector<ScoreType>(),
+                              Aggregate aggregate = AGGREGATE_SUM) {
+        assert(weights.empty() || weights.size() == sets.size());
+        return zstore_generic(sets.empty() ? NULL : &sets[0], sets.size(),
+                              weights.empty() ? NULL : &weights[0], aggregate, false);
+    }
+
+    unsigned long zinterstore(const std::vector<const SortedSet*> &sets,
+                              const std::vector<ScoreType> &weights = std::vector<ScoreType>(),
+                              Aggregate aggregate = AGGREGATE_SUM) {
+        assert(weights.empty() || weights.size() == sets.size());
+        return zstore_generic(sets.empty() ? NULL : &sets[0], sets.size(),
+                              weights.empty() ? NULL : &weights[0], aggregate, true);
+    }
+
+    void zremrangebylex(const LexBound &min, const LexBound &max) {
+        if (is_small()) {
+            std::size_t first = small_lex_bound(min, max, false), last = small_lex_bound(min, max, true);
+            if (first < last) {
+                expire_forget(first, last);
+                mSmall.erase(mSmall.begin() + first, mSmall.begin() + last);
+            }
             return;
         }
-        if (end >= llen) end = llen-1;
-        unsigned long rangelen = (end-start)+1;
+        private_delete_range_by_lex(min, max);
+        maybe_demote();
+    }
 
-        SkipListNode *ln;
-        /* Check if starting point is trivial, before doing log(N) lookup. */
-        if (reverse) {
-            ln = mTail;
-            if (start > 0)
-                ln = get_element_by_rank(llen-start);
-        } else {
-            ln = mHeader->mLevel[0].mForward;
-            if (start > 0)
-                ln = get_element_by_rank(start+1);
-        }
+    /* Iterator flavours: the whole set, and views of the same ranges as the
+     * range commands above. */
+    const_iterator begin() const {
+        if (is_small())
+            return const_iterator(mSmall.data(), this);
+        return const_iterator(mHeader->mLevel[0].mForward, this);
+    }
+
+    const_iterator end() const {
+        if (is_small())
+            return const_iterator(mSmall.data() + mSmall.size(), this);
+        return const_iterator((const SkipListNode*)NULL, this);
+    }
+
+    const_reverse_iterator rbegin() const {
+        if (is_small())
+            return const_reverse_iterator(mSmall.data() + mSmall.size(), this);
+        return const_reverse_iterator(mTail, this);
+    }
 
-        while(rangelen--) {
-            assert(ln != NULL);
-            result.push_back(std::make_pair(ln->mKey, ln->mScore));
-            ln = reverse ? ln->mBackward : ln->mLevel[0].mForward;
+    const_reverse_iterator rend() const {
+        if (is_small())
+            return const_reverse_iterator(mSmall.data(), this);
+        return const_reverse_iterator((const SkipListNode*)NULL, this);
+    }
+
+    RangeViewType zrange_view(long start, long end) const {
+        if (!sanitize_rank_range(start, end)) {
+            return RangeViewType(this->end(), this->end());
         }
+        if (is_small()) {
+            return RangeViewType(const_iterator(mSmall.data() + start, this),
+                                 const_iterator(mSmall.data() + end + 1, this));
+        }
+        SkipListNode *last = get_element_by_index(end, false);
+        return RangeViewType(const_iterator(get_element_by_index(start, false), this),
+                             const_iterator(last->mLevel[0].mForward, this));
     }
 
-    void zrangebyscore_generic(double min, double max, bool reverse, KeyVecType &result, 
-                               bool minex = false, bool maxex = false) {
-        result.clear();
-        RangeSpec range((reverse?max:min), (reverse?min:max), (reverse?maxex:minex), (reverse?minex:maxex));
-        SkipListNode *ln;
+    ReverseRangeViewType zrevrange_view(long start, long end) const {
+        if (!sanitize_rank_range(start, end)) {
+            return ReverseRangeViewType(rend(), rend());
+        }
+        if (is_small()) {
+            const KeyScorePairType *tail = mSmall.data() + mSmall.size();
+            return ReverseRangeViewType(const_reverse_iterator(tail - start, this),
+                                        const_reverse_iterator(tail - end - 1, this));
+        }
+        SkipListNode *last = get_element_by_index(end, true);
+        return ReverseRangeViewType(const_reverse_iterator(get_element_by_index(start, true), this),
+                                    const_reverse_iterator(last->mBackward, this));
+    }
 
-        /* If reversed, get the last node in range as starting point. */
-        if (reverse) {
-            ln = last_in_range(range);
-        } else {
-            ln = first_in_range(range);
+    RangeViewType zrangebyscore_view(ScoreType min, ScoreType max, bool minex = false, bool maxex = false) const {
+        RangeSpec range = score_range(min, max, false, minex, maxex);
+        if (is_small()) {
+            std::size_t first = small_score_bound(range, false), last = small_score_bound(range, true);
+            if (first >= last)
+                return RangeViewType(end(), end());
+            return RangeViewType(const_iterator(mSmall.data() + first, this),
+                                 const_iterator(mSmall.data() + last, this));
+        }
+        SkipListNode *first = first_in_range(range);
+        if (first == NULL) {
+            return RangeViewType(end(), end());
         }
+        return RangeViewType(const_iterator(first, this),
+                             const_iterator(last_in_range(range)->mLevel[0].mForward, this));
+    }
 
-        /* No "first" element in the specified interval. */
-        if (ln == NULL) {
-            return;
+    ReverseRangeViewType zrevrangebyscore_view(ScoreType min, ScoreType max, bool minex = false, bool maxex = false) const {
+        RangeSpec range = score_range(min, max, true, minex, maxex);
+        if (is_small()) {
+            std::size_t first = small_score_bound(range, false), last = small_score_bound(range, true);
+            if (first >= last)
+                return ReverseRangeViewType(rend(), rend());
+            return ReverseRangeViewType(const_reverse_iterator(mSmall.data() + last, this),
+                                        const_reverse_iterator(mSmall.data() + first, this));
         }
-        while (ln) {
-            /* Abort when the node is no longer in range. */
-            if (reverse) {
-                if (!score_gte_min(ln->mScore,range)) break;
-            } else {
-                if (!score_lte_max(ln->mScore,range)) break;
-            }
+        SkipListNode *first = last_in_range(range);
+        if (first == NULL) {
+            return ReverseRangeViewType(rend(), rend());
+        }
+        return ReverseRangeViewType(const_reverse_iterator(first, this),
+                                    const_reverse_iterator(first_in_range(range)->mBackward, this));
+    }
 
-            result.push_back(ln->mKey);
+    RangeViewType zrangebylex_view(const LexBound &min, const LexBound &max) const {
+        if (is_small()) {
+            std::size_t first = small_lex_bound(min, max, false), last = small_lex_bound(min, max, true);
+            if (first >= last)
+                return RangeViewType(end(), end());
+            return RangeViewType(const_iterator(mSmall.data() + first, this),
+                                 const_iterator(mSmall.data() + last, this));
+        }
+        SkipListNode *first = first_in_lex_range(min, max);
+        if (first == NULL) {
+            return RangeViewType(end(), end());
+        }
+        return RangeViewType(const_iterator(first, this),
+                             const_iterator(last_in_lex_range(min, max)->mLevel[0].mForward, this));
+    }
 
-            /* Move to next node */
-            if (reverse) {
-                ln = ln->mBackward;
-            } else {
-                ln = ln->mLevel[0].mForward;
-            }
+    ReverseRangeViewType zrevrangebylex_view(const LexBound &max, const LexBound &min) const {
+        if (is_small()) {
+            std::size_t first = small_lex_bound(min, max, false), last = small_lex_bound(min, max, true);
+            if (first >= last)
+                return ReverseRangeViewType(rend(), rend());
+            return ReverseRangeViewType(const_reverse_iterator(mSmall.data() + last, this),
+                                        const_reverse_iterator(mSmall.data() + first, this));
+        }
+        SkipListNode *first = last_in_lex_range(min, max);
+        if (first == NULL) {
+            return ReverseRangeViewType(rend(), rend());
         }
+        return ReverseRangeViewType(const_reverse_iterator(first, this),
+                                    const_reverse_iterator(first_in_lex_range(min, max)->mBackward, this));
     }
 
-    void zrangebyscore_withscores_generic(double min, double max, bool reverse, KeyScoreVecType &result, 
-                                          bool minex = false, bool maxex = false) {
-        result.clear();
-        RangeSpec range((reverse?max:min), (reverse?min:max), (reverse?maxex:minex), (reverse?minex:maxex));
-        SkipListNode *ln;
+    unsigned long zcount(ScoreType min, ScoreType max, bool minex = false, bool maxex = false) const {
+        RangeSpec range(min, max, minex, maxex);
+        SkipListNode *zn;
+        unsigned long rank;
+        unsigned long count = 0;
 
-        /* If reversed, get the last node in range as starting point. */
-        if (reverse) {
-            ln = last_in_range(range);
-        } else {
-            ln = first_in_range(range);
+        if (is_small()) {
+            std::size_t first = small_score_bound(range, false), last = small_score_bound(range, true);
+            return (first < last) ? last - first : 0;
         }
 
-        /* No "first" element in the specified interval. */
-        if (ln == NULL) {
-            return;
-        }
-        while (ln) {
-            /* Abort when the node is no longer in range. */
-            if (reverse) {
-                if (!score_gte_min(ln->mScore,range)) break;
-            } else {
-                if (!score_lte_max(ln->mScore,range)) break;
-            }
+        /* Find first element in range, the descent gives its rank too */
+        zn = first_in_range(range, &rank);
+
+        /* Use rank of first element, if any, to determine preliminary count */
+        if (zn != NULL) {
+            count = (mLength - (rank - 1));
 
-            result.push_back(std::make_pair(ln->mKey, ln->mScore));
+            /* Find last element in range, with its rank */
+            zn = last_in_range(range, &rank);
 
-            /* Move to next node */
-            if (reverse) {
-                ln = ln->mBackward;
-            } else {
-                ln = ln->mLevel[0].mForward;
+            /* Use rank of last element, if any, to determine the actual count */
+            if (zn != NULL) {
+                count -= (mLength - rank);
             }
         }
+        return count;
     }
 
-    bool zrank_generic(KeyType key, bool reverse, unsigned long &rank) {
-        unsigned long llen = length();
-        DictTypeIterator it = mDict.find(key);
-        if (it != mDict.end()) {
-            double score = it->second;
-            rank = get_rank(score, key);
-            if (reverse) {
-                rank = llen - rank;
-            }
-            else {
-                rank -= 1;
-            }
+    unsigned long zcard() const {
+        return length();
+    }
+
+    bool zscore(const KeyType &key, ScoreType &score) const {
+        if (is_small()) {
+            long i = small_find(key);
+            if (i >= 0)
+                score = mSmall[i].second;
+            return i >= 0;
+        }
+        SkipListNode *x = mDict.find(key);
+        if (x != NULL) {
+            score = x->mScore;
             return true;
         }
         else {
@@ -533,183 +2868,675 @@ private:
         }
     }
 
-public:
-    void zadd(KeyType key, double score) {
-        zadd_generic(key, score, false);
+    bool zrank(const KeyType &key, unsigned long &rank) const {
+        return zrank_generic(key, false, rank);
     }
-    
-    void zincrby(KeyType key, double score) {
-        zadd_generic(key, score, true);
+
+    bool zrevrank(const KeyType &key, unsigned long &rank) const {
+        return zrank_generic(key, true, rank);
     }
 
-    void zrem(KeyType key) {
-        DictTypeIterator it = mDict.find(key);
-        if (it != mDict.end()) {
-            double score = it->second;
-            private_delete(score, key);
-            mDict.erase(it);
-        }
+    /* Sets of up to 'entries' elements, whose keys are all up to 'keysize'
+     * long (see SortedSetKeySize), use the compact encoding: a single sorted
+     * array of (key, score) pairs, searched by binary search (keys by linear
+     * scan), without skiplist header, dict or per element allocation. Past
+     * either limit the set converts to the skiplist and dict, and converts
+     * back once zremrangebyscore/zremrangebyrank/zrem_many leave at most
+     * half of 'entries' elements. 0 entries disables the compact encoding.
+     * The defaults are 128 entries and 64 bytes keys. */
+    void set_compact_limits(std::size_t entries, std::size_t keysize) {
+        mCompactEntries = entries;
+        mCompactKeySize = keysize;
+        if (!is_small())
+            return;
+        bool fits = mSmall.size() <= entries && entries > 0;
+        for (std::size_t i = 0; fits && i < mSmall.size(); i++)
+            fits = small_key_fits(mSmall[i].first);
+        if (!fits)
+            promote();
     }
 
-    void zremrangebyscore(double min, double max, bool minex = false, bool maxex = false) {
-        RangeSpec range(min, max, minex, maxex);
-        private_delete_range_by_score(range);
+    bool is_compact() const {
+        return is_small();
     }
 
-    void zremrangebyrank(long start, long end) {
-        long llen = length();
-        if (start < 0) start = llen + start;
-        if (end < 0) end = llen + end;
-        if (start < 0) start = 0;
-        /* Invariant: start >= 0, so this test will be true when end < 0.
-         * The range is empty when start > end or start >= length. */
-        if (start > end || start >= llen) {
-            return;
+    /* The shape and memory of a set, see stats(). Byte counts are what was
+     * asked from the allocator (SortedSetPoolAllocator rounds nodes up to
+     * 16 bytes), memory the keys own themselves (std::string buffers) is
+     * not counted. */
+    class Stats {
+    public:
+        unsigned long mMembers;
+        bool mCompact;
+        /* Number of nodes with i+1 levels, and the highest level in use */
+        unsigned long mLevels[SKIPLIST_MAXLEVEL];
+        int mLevel;
+        /* Average rank distance covered by the links of level i */
+        double mAverageSpan[SKIPLIST_MAXLEVEL];
+        std::size_t mBuckets;
+        double mLoadFactor;
+        /* The skiplist nodes (the header alone in mHeaderBytes), the dict
+         * buckets, the compact array, the expiry times (an estimate of the
+         * std containers holding them), and all of it with the set itself */
+        std::size_t mNodeBytes, mHeaderBytes, mDictBytes, mCompactBytes, mExpireBytes, mTotalBytes;
+        double mBytesPerMember;
+    };
+
+    /* The instrumentation policy of the set, to read its counters. */
+    const Instrument& instrument() const {
+        return mInstrument;
+    }
+
+    /* Bytes used by the set, in O(1): the same as stats().mTotalBytes. */
+    std::size_t memory_usage() const {
+        return sizeof(*this) + mNodeBytes + mDict.bucket_count() * sizeof(SkipListNode*)
+            + mSmall.capacity() * sizeof(KeyScorePairType) + expire_bytes();
+    }
+
+    /* Walk the set to fill 'result', in O(N). */
+    void stats(Stats &result) const {
+        unsigned long links[SKIPLIST_MAXLEVEL] = { 0 };
+        double spans[SKIPLIST_MAXLEVEL] = { 0 };
+        int i;
+
+        result.mMembers = length();
+        result.mCompact = is_small();
+        result.mLevel = is_small() ? 0 : mLevel;
+        for (i = 0; i < SKIPLIST_MAXLEVEL; i++)
+            result.mLevels[i] = 0;
+        for (SkipListNode *x = mHeader; x != NULL; x = x->mLevel[0].mForward) {
+            if (x != mHeader)
+                result.mLevels[x->mLevelCount - 1]++;
+            for (i = 0; i < x->mLevelCount && i < mLevel; i++) {
+                if (x->mLevel[i].mForward != NULL) {
+                    links[i]++;
+                    spans[i] += x->mLevel[i].mSpan;
+                }
+            }
         }
-        if (end >= llen) end = llen - 1;
-        /* Correct for 1-based rank. */
-        private_delete_range_by_rank(start+1, end+1);
+        for (i = 0; i < SKIPLIST_MAXLEVEL; i++)
+            result.mAverageSpan[i] = links[i] ? spans[i] / links[i] : 0;
+        result.mBuckets = mDict.bucket_count();
+        result.mLoadFactor = result.mBuckets ? (double)mDict.size() / result.mBuckets : 0;
+        result.mNodeBytes = mNodeBytes;
+        result.mHeaderBytes = mHeader ? node_size(SKIPLIST_MAXLEVEL) : 0;
+        result.mDictBytes = result.mBuckets * sizeof(SkipListNode*);
+        result.mCompactBytes = mSmall.capacity() * sizeof(KeyScorePairType);
+        result.mExpireBytes = expire_bytes();
+        result.mTotalBytes = memory_usage();
+        result.mBytesPerMember = result.mMembers ? (double)result.mTotalBytes / result.mMembers : 0;
     }
 
-    void zrange(long start, long end, KeyVecType &result) {
-        zrange_generic(start, end, false, result);
+    /* Bound the set to 'capacity' elements (0 for no bound), for top-K
+     * boards: once full, adding a new member evicts the lowest scored one
+     * (the highest scored one unless 'keephighest'), and a member that would
+     * be evicted right away is turned down by a single compare with the
+     * end of the set. Score updates of members already in the set never
+     * evict anything. Lowering the capacity evicts at once. */
+    void set_capacity(unsigned long capacity, bool keephighest = true) {
+        mCapacity = capacity;
+        mKeepHighest = keephighest;
+        capped_trim();
     }
-    
-    void zrevrange(long start, long end, KeyVecType &result) {
-        zrange_generic(start, end, true, result);
+
+    unsigned long capacity() const {
+        return mCapacity;
     }
-    
-    void zrange_withscores(long start, long end, KeyScoreVecType &result) {
-        zrange_withscores_generic(start, end, false, result);
+
+    /* Like PEXPIREAT: remove 'key' once now_ms() (milliseconds since the
+     * epoch) reaches 'when'. Expired members are removed by expire_step(),
+     * and a few at a time by every zadd/zincrby/zrem, never all at once;
+     * until then they are still returned by the read commands. The expiry
+     * times live in a hash table and a min-heap of their own, which cost
+     * nothing to sets without them. Removing a member forgets its expiry
+     * time. Returns false when 'key' is not a member. */
+    bool pexpireat(const KeyType &key, unsigned long long when) {
+        if (!private_exists(key))
+            return false;
+        std::pair<typename ExpireDictType::iterator, bool> it = mExpires.insert(std::make_pair(key, when));
+        if (!it.second) {
+            if (it.first->second == when)
+                return true;
+            it.first->second = when;
+        }
+        /* The old entry of a changed time stays in the heap, see expire_shrink(). */
+        if (mExpireHeap.size() >= 2 * mExpires.size() + 64) {
+            expire_compact();
+        }
+        else {
+            mExpireHeap.push_back(ExpireEntry(when, key));
+            std::push_heap(mExpireHeap.begin(), mExpireHeap.end(), ExpireLater());
+        }
+        return true;
     }
-    
-    void zrevrange_withscores(long start, long end, KeyScoreVecType &result) {
-        zrange_withscores_generic(start, end, true, result);
+
+    /* Like PEXPIRE: remove 'key' in 'ttl' milliseconds. */
+    bool pexpire(const KeyType &key, unsigned long long ttl) {
+        return pexpireat(key, now_ms() + ttl);
     }
-    
-    void zrangebyscore(double min, double max, KeyVecType &result, bool minex = false, bool maxex = false) {
-        zrangebyscore_generic(min, max, false, result, minex, maxex);
+
+    /* Like PERSIST: false when 'key' is not a member or had no expiry time. */
+    bool persist(const KeyType &key) {
+        if (mExpires.empty() || mExpires.erase(key) == 0)
+            return false;
+        expire_shrink();
+        return true;
     }
-    
-    void zrevrangebyscore(double min, double max, KeyVecType &result, bool minex = false, bool maxex = false) {
-        zrangebyscore_generic(min, max, true, result, minex, maxex);
+
+    /* Like PEXPIRETIME: false when 'key' is not a member or has no expiry time. */
+    bool pexpiretime(const KeyType &key, unsigned long long &when) const {
+        typename ExpireDictType::const_iterator it = mExpires.find(key);
+        if (it == mExpires.end())
+            return false;
+        when = it->second;
+        return true;
     }
-    
-    void zrangebyscore_withscores(double min, double max, KeyScoreVecType &result, bool minex = false, bool maxex = false) {
-        zrangebyscore_withscores_generic(min, max, false, result, minex, maxex);
+
+    /* Remove the members whose expiry time is up to 'now', looking at no more
+     * than 'budget' expiry entries (stale ones included), soonest first, so
+     * each call takes O(budget log(N)) at most. Returns how many members it
+     * removed, which may be 0 when all it looked at were stale entries: see
+     * expire_pending(). The part of the budget left unused goes to *unused
+     * when it is not NULL. */
+    std::size_t expire_step(std::size_t budget, unsigned long long now, std::size_t *unused = NULL) {
+        std::size_t removed = 0;
+        while (budget > 0 && !mExpireHeap.empty() && mExpireHeap.front().mWhen <= now) {
+            std::pop_heap(mExpireHeap.begin(), mExpireHeap.end(), ExpireLater());
+            ExpireEntry entry(std::move(mExpireHeap.back()));
+            mExpireHeap.pop_back();
+            budget--;
+            typename ExpireDictType::iterator it = mExpires.find(entry.mKey);
+            if (it == mExpires.end() || it->second != entry.mWhen)
+                continue;
+            mExpires.erase(it);
+            private_zrem(entry.mKey);
+            removed++;
+        }
+        if (mExpires.empty())
+            mExpireHeap.clear();
+        if (unused != NULL)
+            *unused = budget;
+        return removed;
     }
-    
-    void zrevrangebyscore_withscores(double min, double max, KeyScoreVecType &result, bool minex = false, bool maxex = false) {
-        zrangebyscore_withscores_generic(min, max, true, result, minex, maxex);
+
+    std::size_t expire_step(std::size_t budget) {
+        return expire_step(budget, now_ms());
     }
 
-    unsigned long zcount(double min, double max, bool minex = false, bool maxex = false) {
-        RangeSpec range(min, max, minex, maxex);
-        SkipListNode *zn;
-        unsigned long rank;
-        unsigned long count = 0;
+    /* How many expired members every zadd/zincrby/zrem reclaims at most,
+     * EXPIRE_BATCH by default. 0 leaves them all to expire_step(), and keeps
+     * the writes from reading the clock: ConcurrentSortedSet does that to
+     * keep its two copies of the set alike. */
+    void set_expire_batch(std::size_t batch) {
+        mExpireBatch = batch;
+    }
 
-        /* Find first element in range */
-        zn = first_in_range(range);
+    /* Whether expire_step(budget, now) has anything left to look at. */
+    bool expire_pending(unsigned long long now) const {
+        return !mExpireHeap.empty() && mExpireHeap.front().mWhen <= now;
+    }
 
-        /* Use rank of first element, if any, to determine preliminary count */
-        if (zn != NULL) {
-            rank = get_rank(zn->mScore, zn->mKey);
-            count = (mLength - (rank - 1));
+    /* The clock of expiry times: milliseconds since the epoch. */
+    static unsigned long long now_ms() {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+    }
 
-            /* Find last element in range */
-            zn = last_in_range(range);
+    /* Restart the node level generator. Sets start with the same seed, so
+     * the same inserts build the same skiplist: give them different seeds
+     * if that matters (a 0 seed stands for the default one). */
+    void set_seed(unsigned long long seed) {
+        mRandom = (seed != 0) ? seed : RANDOM_SEED;
+    }
 
-            /* Use rank of last element, if any, to determine the actual count */
-            if (zn != NULL) {
-                rank = get_rank(zn->mScore, zn->mKey);
-                count -= (mLength - rank);
+    /* Number of elements sorting before (score, key), which does not need to
+     * be in the set: the rank it has, or would have once added. */
+    unsigned long count_before(ScoreType score, const KeyType &key) const {
+        if (is_small())
+            return small_lower(score, key);
+        SkipListNode *x = mHeader;
+        unsigned long rank = 0;
+        for (int i = mLevel-1; i >= 0; i--) {
+            while (x->mLevel[i].mForward && forward_less(x, i, score, key)) {
+                rank += x->mLevel[i].mSpan;
+                x = x->mLevel[i].mForward;
             }
         }
-        return count;
+        return rank;
     }
 
-    unsigned long zcard() {
-        return length();
+    /* Binary snapshots, in host byte order:
+     *     header   "ZSET", version, flags, score format, element count (64 bits)
+     *     scores   every score as a packed ScoreType, in rank order
+     *     keys     every key, through SortedSetKeyCodec, in rank order
+     *     checksum optional 64 bits FNV-1a of everything before it
+     * save() streams the elements straight from the skiplist, load() reads a
+     * buffer in place (an mmap()ed file for load_file()) and bulk loads it. */
+    bool save(std::ostream &os, bool checksum = true) const {
+        SnapshotWriter w(os);
+        SnapshotHeader header;
+        std::memcpy(header.mMagic, snapshot_magic(), sizeof(header.mMagic));
+        header.mVersion = SNAPSHOT_VERSION;
+        header.mFlags = checksum ? SNAPSHOT_CHECKSUM : 0;
+        header.mScoreFormat = snapshot_score_format();
+        header.mCount = length();
+        w.write(&header, sizeof(header));
+
+        if (is_small()) {
+            for (std::size_t i = 0; i < mSmall.size(); i++)
+                w.write(&mSmall[i].second, sizeof(mSmall[i].second));
+            for (std::size_t i = 0; i < mSmall.size(); i++)
+                SortedSetKeyCodec<KeyType>::encode(mSmall[i].first, w);
+        }
+        else {
+            SkipListNode *x;
+            for (x = mHeader->mLevel[0].mForward; x; x = x->mLevel[0].mForward)
+                w.write(&x->mScore, sizeof(x->mScore));
+            for (x = mHeader->mLevel[0].mForward; x; x = x->mLevel[0].mForward)
+                SortedSetKeyCodec<KeyType>::encode(x->mKey, w);
+        }
+
+        if (checksum) {
+            unsigned long long sum = w.checksum();
+            w.write(&sum, sizeof(sum));
+        }
+        return !os.fail();
     }
 
-    bool zscore(KeyType key, double &score) {
-        DictTypeConstIterator it = mDict.find(key);
-        if (it != mDict.end()) {
-            score = it->second;
-            return true;
+    bool save_file(const char *path, bool checksum = true) const {
+        std::ofstream os(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        return os && save(os, checksum) && os.flush();
+    }
+
+    /* Replace the content of the set with a snapshot. Returns false, leaving
+     * the set empty, when the data is truncated or corrupt. */
+    bool load(const char *data, std::size_t size) {
+        SnapshotHeader header;
+        const char *end = data + size;
+
+        private_clear();
+        if (size < sizeof(header))
+            return false;
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.mMagic, snapshot_magic(), sizeof(header.mMagic)) != 0 ||
+            header.mVersion != SNAPSHOT_VERSION || header.mScoreFormat != snapshot_score_format())
+            return false;
+        if (header.mFlags & SNAPSHOT_CHECKSUM) {
+            unsigned long long sum;
+            if (size < sizeof(header) + sizeof(sum))
+                return false;
+            end -= sizeof(sum);
+            std::memcpy(&sum, end, sizeof(sum));
+            if (snapshot_checksum(SNAPSHOT_CHECKSUM_SEED, data, end - data) != sum)
+                return false;
         }
-        else {
+        if (header.mCount > (std::size_t)(end - data - sizeof(header)) / sizeof(ScoreType))
             return false;
+
+        const char *scores = data + sizeof(header);
+        const char *p = scores + header.mCount * sizeof(ScoreType);
+        Finger finger;
+        if (is_small() && header.mCount > mCompactEntries)
+            promote();
+        /* Small sets are filled the general way. */
+        bool sorted = !is_small();
+        if (sorted) {
+            mDict.reserve(header.mCount);
+            finger_reset(finger);
         }
+        for (unsigned long long i = 0; i < header.mCount; i++) {
+            ScoreType score;
+            KeyType key;
+            std::memcpy(&score, scores + i * sizeof(ScoreType), sizeof(score));
+            if (!SortedSetKeyCodec<KeyType>::decode(p, end, key)) {
+                if (sorted) private_append_finish(finger);
+                private_clear();
+                return false;
+            }
+            if (sorted && private_append(finger, score, std::move(key)))
+                continue;
+            /* Not in (score, key) order after all, go the general way. */
+            if (sorted) {
+                private_append_finish(finger);
+                sorted = false;
+            }
+            zadd_generic(std::move(key), score, false);
+        }
+        if (sorted)
+            private_append_finish(finger);
+        capped_trim();
+        return true;
     }
 
-    bool zrank(KeyType key, unsigned long &rank) {
-        return zrank_generic(key, false, rank);
+    bool load_file(const char *path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) < 0 || st.st_size == 0) {
+            close(fd);
+            return load(NULL, 0);
+        }
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+            return false;
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+        bool loaded = load(static_cast<const char*>(data), st.st_size);
+        munmap(data, st.st_size);
+        return loaded;
     }
 
-    bool zrevrank(KeyType key, unsigned long &rank) {
-        return zrank_generic(key, true, rank);
+public:
+    SortedSet():mHeader(NULL), mTail(NULL), mLength(0), mLevel(1), mNodeBytes(0),
+        mCompactEntries(COMPACT_MAX_ENTRIES), mCompactKeySize(COMPACT_MAX_KEY_SIZE), mFrozen(NULL),
+        mCapacity(0), mKeepHighest(true), mRandom(RANDOM_SEED), mFingerValid(false), mExpireBatch(EXPIRE_BATCH)
+    {
     }
 
-public:
-    SortedSet():mTail(NULL), mLength(0), mLevel(1), mDict()
+    /* Build a set from elements sorted by score then key (like a zrange_withscores()
+     * result), in O(N). Unsorted input is accepted too, it just loads slower. */
+    SortedSet(const KeyScorePairType *items, std::size_t count):mHeader(NULL), mTail(NULL), mLength(0), mLevel(1), mNodeBytes(0),
+        mCompactEntries(COMPACT_MAX_ENTRIES), mCompactKeySize(COMPACT_MAX_KEY_SIZE), mFrozen(NULL),
+        mCapacity(0), mKeepHighest(true), mRandom(RANDOM_SEED), mFingerValid(false), mExpireBatch(EXPIRE_BATCH)
     {
-        mHeader = new SkipListNode(SKIPLIST_MAXLEVEL);
+        private_load(items, count);
     }
 
-    ~SortedSet() 
+    SortedSet(const KeyScoreVecType &items):mHeader(NULL), mTail(NULL), mLength(0), mLevel(1), mNodeBytes(0),
+        mCompactEntries(COMPACT_MAX_ENTRIES), mCompactKeySize(COMPACT_MAX_KEY_SIZE), mFrozen(NULL),
+        mCapacity(0), mKeepHighest(true), mRandom(RANDOM_SEED), mFingerValid(false), mExpireBatch(EXPIRE_BATCH)
+    {
+        if (!items.empty())
+            private_load(&items[0], items.size());
+    }
+
+    /* Copies have the limits, capacity and key comparator of the original,
+     * but no frozen views. */
+    SortedSet(const SortedSet &other):mHeader(NULL), mTail(NULL), mLength(0), mLevel(1), mNodeBytes(0),
+        mKeyCompare(other.mKeyCompare), mCompactEntries(other.mCompactEntries), mCompactKeySize(other.mCompactKeySize),
+        mFrozen(NULL), mCapacity(other.mCapacity), mKeepHighest(other.mKeepHighest), mRandom(other.mRandom),
+        mFingerValid(false), mExpires(other.mExpires), mExpireHeap(other.mExpireHeap), mExpireBatch(other.mExpireBatch)
     {
-        SkipListNode *node = mHeader->mLevel[0].mForward, *next;
-        delete mHeader;
-        while (node) {
-            next = node->mLevel[0].mForward;
-            delete node;
-            node = next;
+        private_copy(other);
+    }
+
+    /* Moves steal the nodes, 'other' is left empty. Neither set may have
+     * frozen views, which point to their set. */
+    SortedSet(SortedSet &&other):mHeader(NULL), mTail(NULL), mLength(0), mLevel(1), mNodeBytes(0),
+        mCompactEntries(COMPACT_MAX_ENTRIES), mCompactKeySize(COMPACT_MAX_KEY_SIZE), mFrozen(NULL),
+        mCapacity(0), mKeepHighest(true), mRandom(RANDOM_SEED), mFingerValid(false), mExpireBatch(EXPIRE_BATCH)
+    {
+        swap(other);
+    }
+
+    SortedSet& operator=(const SortedSet &other)
+    {
+        if (this != &other) {
+            SortedSet copy(other);
+            swap(copy);
         }
+        return *this;
+    }
+
+    SortedSet& operator=(SortedSet &&other)
+    {
+        SortedSet moved(std::move(other));
+        swap(moved);
+        return *this;
+    }
+
+    /* Exchange the contents (and settings) of two sets in O(1), for
+     * instance to put a set built offline in place of the live one. */
+    void swap(SortedSet &other)
+    {
+        assert(mFrozen == NULL && other.mFrozen == NULL);
+        std::swap(mHeader, other.mHeader);
+        std::swap(mTail, other.mTail);
+        std::swap(mLength, other.mLength);
+        std::swap(mLevel, other.mLevel);
+        std::swap(mNodeBytes, other.mNodeBytes);
+        mDict.swap(other.mDict);
+        mAllocator.swap(other.mAllocator);
+        std::swap(mKeyCompare, other.mKeyCompare);
+        mSmall.swap(other.mSmall);
+        std::swap(mCompactEntries, other.mCompactEntries);
+        std::swap(mCompactKeySize, other.mCompactKeySize);
+        std::swap(mCapacity, other.mCapacity);
+        std::swap(mKeepHighest, other.mKeepHighest);
+        std::swap(mRandom, other.mRandom);
+        std::swap(mFinger, other.mFinger);
+        std::swap(mFingerValid, other.mFingerValid);
+        mExpires.swap(other.mExpires);
+        mExpireHeap.swap(other.mExpireHeap);
+        std::swap(mExpireBatch, other.mExpireBatch);
+    }
+
+    ~SortedSet() 
+    {
+        /* Frozen views must be destroyed before their set. */
+        assert(mFrozen == NULL);
+        free_all_nodes();
     }
 
 private:
     class SkipListNode {
     public:
-        SkipListNode(int level): mIsHeader(true), mScore(0), mBackward(NULL)
-        {
-            mLevel = new SkipListLevel[level];
+        template<typename K>
+        SkipListNode(int level, ScoreType score, K &&key)
+            : mScore(score), mKey(std::forward<K>(key)), mLevelCount(level), mBackward(NULL), mHashNext(NULL) {}
+
+    public:
+        /* SkipListNode maybe used as a SkipList's 'header' node (mHeader), which will never take
+         * a real key/score, so the key/score field of the 'header' node is always invalid.
+         * Nodes are always created by create_node(), mLevel must be the last member: the
+         * real level array extends past the end of the object. */
+        ScoreType mScore;
+        KeyType mKey;
+        unsigned char mLevelCount;
+        SkipListNode *mBackward;
+        /* Next node in the same Dict bucket */
+        SkipListNode *mHashNext;
+        SkipListLevel mLevel[1];
+    };
+
+    /* The hash table view of the set: an intrusive hash table of the skiplist
+     * nodes themselves, chained through SkipListNode::mHashNext. Each key is
+     * only stored once, in its node, and a lookup gives the node straight away. */
+    class Dict {
+    public:
+        Dict(): mBuckets(NULL), mBucketCount(0), mShift(64), mSize(0) {}
+
+        ~Dict() {
+            delete [] mBuckets;
         }
 
-        SkipListNode(int level, double score, KeyType key): mIsHeader(false), mScore(score), mKey(key), mBackward(NULL)
-        {
-            mLevel = new SkipListLevel[level];
+        std::size_t hash(const KeyType &key) const {
+            return mHash(key);
         }
 
-        ~SkipListNode()
-        {
-            if (mLevel) delete [] mLevel;
+        SkipListNode* find(const KeyType &key) const {
+            return find(key, hash(key));
+        }
+
+        /* 'h' is hash(key), for callers which already computed it. */
+        SkipListNode* find(const KeyType &key, std::size_t h) const {
+            if (mSize == 0) return NULL;
+            SkipListNode *x = mBuckets[bucket_of(h)];
+            while (x && !mEqual(x->mKey, key))
+                x = x->mHashNext;
+            return x;
+        }
+
+        /* The node's key must not be in the table already. */
+        void insert(SkipListNode *x) {
+            insert(x, hash(x->mKey));
+        }
+
+        void insert(SkipListNode *x, std::size_t h) {
+            if (mSize >= mBucketCount)
+                rehash(mBucketCount ? mBucketCount * 2 : 4);
+            SkipListNode **bucket = &mBuckets[bucket_of(h)];
+            x->mHashNext = *bucket;
+            *bucket = x;
+            mSize++;
+        }
+
+        void erase(SkipListNode *x) {
+            SkipListNode **link = &mBuckets[bucket_of(hash(x->mKey))];
+            while (*link != x) {
+                assert(*link != NULL);
+                link = &(*link)->mHashNext;
+            }
+            *link = x->mHashNext;
+            mSize--;
+        }
+
+        void clear() {
+            for (std::size_t i = 0; i < mBucketCount; i++)
+                mBuckets[i] = NULL;
+            mSize = 0;
+        }
+
+        /* Empty the table and free the buckets. */
+        void release() {
+            delete [] mBuckets;
+            mBuckets = NULL;
+            mBucketCount = 0;
+            mShift = 64;
+            mSize = 0;
         }
 
+        bool equal(const KeyType &a, const KeyType &b) const {
+            return mEqual(a, b);
+        }
+
+        std::size_t size() const {
+            return mSize;
+        }
+
+        std::size_t bucket_count() const {
+            return mBucketCount;
+        }
+
+        void swap(Dict &other) {
+            std::swap(mBuckets, other.mBuckets);
+            std::swap(mBucketCount, other.mBucketCount);
+            std::swap(mShift, other.mShift);
+            std::swap(mSize, other.mSize);
+            std::swap(mHash, other.mHash);
+            std::swap(mEqual, other.mEqual);
+        }
+
+        /* Make room for 'count' nodes without rehashing. */
+        void reserve(std::size_t count) {
+            std::size_t buckets = mBucketCount ? mBucketCount : 4;
+            while (buckets < count)
+                buckets *= 2;
+            if (buckets > mBucketCount)
+                rehash(buckets);
+        }
+
+    private:
+        Dict(const Dict&);
+        Dict& operator=(const Dict&);
+
+        /* Fibonacci hashing: spreads poor hashes (like identity hashing of
+         * integers) over the power of two table. */
+        std::size_t bucket_of(std::size_t h) const {
+            return (std::size_t)(((unsigned long long)h * 11400714819323198485ULL) >> mShift);
+        }
+
+        void rehash(std::size_t count) {
+            SkipListNode **old = mBuckets;
+            std::size_t oldcount = mBucketCount;
+            mBuckets = new SkipListNode*[count]();
+            mBucketCount = count;
+            for (mShift = 64; count > 1; count >>= 1)
+                mShift--;
+            for (std::size_t i = 0; i < oldcount; i++) {
+                SkipListNode *x = old[i], *next;
+                while (x) {
+                    next = x->mHashNext;
+                    SkipListNode **bucket = &mBuckets[bucket_of(hash(x->mKey))];
+                    x->mHashNext = *bucket;
+                    *bucket = x;
+                    x = next;
+                }
+            }
+            delete [] old;
+        }
+
+        SkipListNode **mBuckets;
+        std::size_t mBucketCount;
+        int mShift;
+        std::size_t mSize;
+        HashFn mHash;
+        EqualKey mEqual;
+    };
+
+    /* The search path of a batch of insertions or deletions, see finger_search(). */
+    class Finger {
     public:
-        /* SkipListNode maybe used as a SkipList's 'header' node, which will never take a real key/score.
-         * So the key/score field of a 'header' SkipListNode is always invalid, 
-         * and we need this flag to judge 'header' node. */
-        bool mIsHeader;
-        double mScore;
-        KeyType mKey;
-        SkipListNode *mBackward;
-        SkipListLevel *mLevel;
+        SkipListNode *mUpdate[SKIPLIST_MAXLEVEL];
+        unsigned long mRank[SKIPLIST_MAXLEVEL];
+    };
+
+    static const unsigned int SNAPSHOT_VERSION = 2;
+    static const unsigned int SNAPSHOT_CHECKSUM = 1;
+    static const unsigned long long SNAPSHOT_CHECKSUM_SEED = 14695981039346656037ULL;
+    static const char* snapshot_magic() {
+        return "ZSET";
+    }
+
+    /* 0 for double scores (the only ones before the score format was
+     * recorded), otherwise the size of the scores, 0x100 for floating point
+     * ones and 0x200 for signed ones. */
+    static unsigned int snapshot_score_format() {
+        if (std::is_same<ScoreType, double>::value)
+            return 0;
+        return sizeof(ScoreType) | (std::is_floating_point<ScoreType>::value ? 0x100 : 0) |
+               (std::numeric_limits<ScoreType>::is_signed ? 0x200 : 0);
+    }
+
+    class SnapshotHeader {
+    public:
+        char mMagic[4];
+        unsigned int mVersion;
+        unsigned int mFlags;
+        unsigned int mScoreFormat;
+        unsigned long long mCount;
     };
 
-    class SkipListLevel {
+    static unsigned long long snapshot_checksum(unsigned long long sum, const void *p, std::size_t n) {
+        const unsigned char *c = static_cast<const unsigned char*>(p);
+        while (n--) {
+            sum ^= *c++;
+            sum *= 1099511628211ULL;
+        }
+        return sum;
+    }
+
+    /* Writes to the stream, checksumming along the way. */
+    class SnapshotWriter {
     public:
-        SkipListLevel():mForward(NULL), mSpan(0) {}
-        SkipListNode *mForward;
-        unsigned int mSpan;
+        SnapshotWriter(std::ostream &os): mOs(os), mSum(SNAPSHOT_CHECKSUM_SEED) {}
+        void write(const void *p, std::size_t n) {
+            mSum = snapshot_checksum(mSum, p, n);
+            mOs.write(static_cast<const char*>(p), n);
+        }
+        unsigned long long checksum() const { return mSum; }
+    private:
+        std::ostream &mOs;
+        unsigned long long mSum;
     };
 
     class RangeSpec {
     public:
-        RangeSpec(double min, double max, bool minex, bool maxex):mMin(min), mMax(max), mMinex(minex), mMaxex(maxex) {}
+        RangeSpec(ScoreType min, ScoreType max, bool minex, bool maxex):mMin(min), mMax(max), mMinex(minex), mMaxex(maxex) {}
     public:
-        double mMin, mMax;
+        ScoreType mMin, mMax;
         bool mMinex, mMaxex;
     };
 
@@ -718,8 +3545,42 @@ private:
     SkipListNode *mHeader, *mTail;
     unsigned long mLength;
     int mLevel;
+    /* Bytes of all the nodes, mHeader included, see memory_usage() */
+    std::size_t mNodeBytes;
     /* Data structure for the Dict */
-    DictType mDict;
+    Dict mDict;
+    /* Where the nodes come from */
+    Allocator mAllocator;
+    KeyCompare mKeyCompare;
+    /* The compact encoding of small sets, see set_compact_limits() */
+    std::vector<KeyScorePairType> mSmall;
+    unsigned int mCompactEntries, mCompactKeySize;
+    /* The frozen views of the set, see FrozenView */
+    FrozenView *mFrozen;
+    /* The bound of bounded sets, see set_capacity() */
+    unsigned long mCapacity;
+    bool mKeepHighest;
+    /* State of the level generator, see set_seed() */
+    unsigned long long mRandom;
+    /* Where the last single insertion or deletion took place, see finger_seek() */
+    Finger mFinger;
+    bool mFingerValid;
+    /* Expiry times, and the min-heap of them (with stale entries), see pexpireat() */
+    ExpireDictType mExpires;
+    std::vector<ExpireEntry> mExpireHeap;
+    /* Expired members reclaimed by every write, see set_expire_batch() */
+    std::size_t mExpireBatch;
+    /* The 9th template argument, see SortedSetNoInstrument. It stays with
+     * the object, swap() does not exchange it. */
+    mutable Instrument mInstrument;
 };
 
+template<typename KeyType, typename HashFn, typename EqualKey, typename Allocator,
+         typename KeyCompare, typename ScoreType, typename SpanType, bool CacheScores, typename Instrument>
+inline void swap(SortedSet<KeyType, HashFn, EqualKey, Allocator, KeyCompare, ScoreType, SpanType, CacheScores, Instrument> &a,
+                 SortedSet<KeyType, HashFn, EqualKey, Allocator, KeyCompare, ScoreType, SpanType, CacheScores, Instrument> &b)
+{
+    a.swap(b);
+}
+
 #endif